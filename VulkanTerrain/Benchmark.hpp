@@ -0,0 +1,119 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <ostream>
+#include <string>
+
+#include <glm/glm.hpp>
+
+// Quotes and escapes value for JSON. Device names come from the driver and may contain any character
+inline std::string jsonString(const std::string &value) {
+	std::string quoted = "\"";
+	for (char c : value) {
+		if (c == '"' || c == '\\') {
+			quoted += '\\';
+			quoted += c;
+		}
+		else if ((unsigned char)c < 0x20) {
+			char escaped[8];
+			snprintf(escaped, sizeof(escaped), "\\u%04x", (unsigned)c);
+			quoted += escaped;
+		}
+		else
+			quoted += c;
+	}
+	return quoted + "\"";
+}
+
+// Fixed set of chunks generated by a benchmark run. Chunks are taken from the box [min, max) in chunk units
+struct BenchmarkScene {
+	const char *name;
+	glm::ivec3 min;
+	glm::ivec3 max;
+	uint32_t lod;
+};
+
+// Timings and throughput of generating one scene with one backend
+struct BenchmarkResult {
+	enum Stage {
+		Uniform,
+		Dispatch,
+		Append,
+		Upload,
+		Readback,
+		STAGE_COUNT
+	};
+
+	std::string backend;
+	std::string scene;
+	uint64_t chunks = 0;
+	uint64_t voxels = 0;
+	uint64_t triangles = 0;
+	uint64_t bytesUploaded = 0;
+	uint64_t bytesReadBack = 0;
+	double totalMs = 0.0;
+	double stageMs[STAGE_COUNT] = {};
+
+	// Writes the result as a single line of JSON
+	void write(std::ostream &out, const std::string &device) const {
+		static const char *stageNames[STAGE_COUNT] = { "uniform", "dispatch", "append", "upload", "readback" };
+		double seconds = totalMs / 1000.0;
+		out << "{\"device\":" << jsonString(device) << ",\"backend\":" << jsonString(backend) << ",\"scene\":" << jsonString(scene)
+			<< ",\"chunks\":" << chunks << ",\"voxels\":" << voxels << ",\"triangles\":" << triangles
+			<< ",\"bytesUploaded\":" << bytesUploaded << ",\"bytesReadBack\":" << bytesReadBack
+			<< ",\"totalMs\":" << totalMs
+			<< ",\"chunksPerSec\":" << chunks / seconds
+			<< ",\"voxelsPerSec\":" << voxels / seconds
+			<< ",\"trianglesPerSec\":" << triangles / seconds
+			<< ",\"stageMs\":{";
+		for (int stage = 0; stage < STAGE_COUNT; ++stage)
+			out << (stage > 0 ? "," : "") << "\"" << stageNames[stage] << "\":" << stageMs[stage];
+		out << "}}\n";
+	}
+};
+
+// One chunk of a scene meshed by BuildMesh.comp and by the host mesher
+struct MesherCheck {
+	std::string scene;
+	glm::ivec3 chunk;
+	uint64_t gpuVertices = 0;
+	uint64_t cpuVertices = 0;
+	uint64_t gpuTriangles = 0;
+	uint64_t cpuTriangles = 0;
+	// Vertices of either mesh without a counterpart in the other
+	uint64_t unmatchedVertices = 0;
+
+	// Samples that round to the other side of the surface change a few cells, so up to 1% may differ
+	bool passed() const {
+		uint64_t vertices = std::max(gpuVertices, cpuVertices);
+		uint64_t triangleDifference = std::max(gpuTriangles, cpuTriangles) - std::min(gpuTriangles, cpuTriangles);
+		return unmatchedVertices * 100 <= vertices && triangleDifference * 100 <= std::max(gpuTriangles, cpuTriangles);
+	}
+
+	// Writes the check as a single line of JSON
+	void write(std::ostream &out, const std::string &device) const {
+		out << "{\"device\":" << jsonString(device) << ",\"check\":\"meshers\",\"scene\":" << jsonString(scene)
+			<< ",\"chunk\":[" << chunk.x << "," << chunk.y << "," << chunk.z << "]"
+			<< ",\"gpuVertices\":" << gpuVertices << ",\"cpuVertices\":" << cpuVertices
+			<< ",\"gpuTriangles\":" << gpuTriangles << ",\"cpuTriangles\":" << cpuTriangles
+			<< ",\"unmatchedVertices\":" << unmatchedVertices
+			<< ",\"passed\":" << (passed() ? "true" : "false") << "}\n";
+	}
+};
+
+// Adds the time since the previous lap to a stage
+class StageTimer {
+public:
+	StageTimer() : last(std::chrono::high_resolution_clock::now()) {}
+
+	void lap(double &stageMs) {
+		auto now = std::chrono::high_resolution_clock::now();
+		stageMs += std::chrono::duration<double, std::milli>(now - last).count();
+		last = now;
+	}
+
+private:
+	std::chrono::high_resolution_clock::time_point last;
+};
@@ -5,8 +5,25 @@
 class Chunk {
 public:
 	static const uint32_t CHUNK_SIZE = 32;
+	// Coarsest level of detail, meshed with a voxel stride of 1 << MAX_LOD
+	static const uint32_t MAX_LOD = 3;
+
+	// Faces of the chunk in the order of the seamFaces and skirtFaces bits
+	enum Face {
+		NegativeX, PositiveX,
+		NegativeY, PositiveY,
+		NegativeZ, PositiveZ
+	};
 
 	glm::ivec3 worldPosition;
+	// Chunks are meshed with a voxel stride of 1 << lod
+	uint32_t lod = 0;
+	// Bit per Face that borders a coarser chunk, the samples along those faces are
+	// taken from the coarser lattice so that both chunks meet without cracks
+	uint32_t seamFaces = 0;
+	// Bit per Face that borders a chunk of another level of detail. The two triangulations still differ inside
+	// the face, so the surface along it is extended by a skirt reaching into the terrain that covers the gaps
+	uint32_t skirtFaces = 0;
 
 	Chunk(glm::ivec3 worldPosition) : worldPosition(worldPosition) {};
 	Chunk(int worldPosition[3]) : worldPosition(glm::ivec3(worldPosition[0], worldPosition[1], worldPosition[2])) {};
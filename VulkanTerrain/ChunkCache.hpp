@@ -0,0 +1,98 @@
+#pragma once
+
+#include <cstdint>
+#include <iterator>
+#include <unordered_map>
+
+#include <glm/glm.hpp>
+
+#include "Chunk.hpp"
+
+// What the samples of a chunk contain, matches the contents flags of ChunkDraw in BuildMesh.comp
+enum ChunkContents {
+	CONTENTS_UNKNOWN = 0,
+	// Every sample lies outside of the terrain
+	CONTENTS_EMPTY = 1,
+	// Every sample lies inside of the terrain
+	CONTENTS_SOLID = 2,
+	CONTENTS_SURFACE = CONTENTS_EMPTY | CONTENTS_SOLID
+};
+
+// A generated chunk, its mesh stays resident in the given slot of the mesh arena
+struct CachedChunk {
+	// Chunks without any geometry don't occupy a slot
+	static const uint32_t NO_ARENA_SLOT = UINT32_MAX;
+
+	uint32_t arenaSlot = NO_ARENA_SLOT;
+	uint32_t vertexCount = 0;
+	uint32_t indexCount = 0;
+	// Level of detail, seams and skirts the mesh was built with, see Chunk
+	uint32_t lod = 0;
+	uint32_t seamFaces = 0;
+	uint32_t skirtFaces = 0;
+	// Empty and solid chunks are never meshed at lod or any coarser level of detail, so they stay
+	// cached for a while after leaving the window, see VulkanTerrain::UNIFORM_CACHE_MARGIN
+	ChunkContents contents = CONTENTS_UNKNOWN;
+
+	bool isUniform() const {
+		return contents == CONTENTS_EMPTY || contents == CONTENTS_SOLID;
+	}
+};
+
+struct ChunkHash {
+	size_t operator()(const glm::ivec3 &p) const {
+		// Large primes spread neighbouring chunk positions across buckets
+		return ((size_t)p.x * 73856093) ^ ((size_t)p.y * 19349663) ^ ((size_t)p.z * 83492791);
+	}
+};
+
+// Stores chunk meshes keyed by Chunk::worldPosition so that only chunks
+// entering the visible window have to be generated, see ChunkManager
+class ChunkCache {
+public:
+	typedef std::unordered_map<glm::ivec3, CachedChunk, ChunkHash> ChunkMap;
+
+	bool contains(glm::ivec3 worldPosition) const {
+		return chunks.find(worldPosition) != chunks.end();
+	}
+
+	CachedChunk &insert(glm::ivec3 worldPosition) {
+		return chunks[worldPosition];
+	}
+
+	// Returns nullptr if the chunk isn't cached
+	const CachedChunk *find(glm::ivec3 worldPosition) const {
+		auto it = chunks.find(worldPosition);
+		return it != chunks.end() ? &it->second : nullptr;
+	}
+
+	void erase(glm::ivec3 worldPosition) {
+		chunks.erase(worldPosition);
+	}
+
+	// Erases every chunk for which predicate(worldPosition, chunk) returns true
+	template<typename Predicate>
+	void eraseIf(Predicate predicate) {
+		for (auto it = chunks.begin(); it != chunks.end();)
+			it = predicate(it->first, it->second) ? chunks.erase(it) : std::next(it);
+	}
+
+	void clear() {
+		chunks.clear();
+	}
+
+	size_t size() const {
+		return chunks.size();
+	}
+
+	ChunkMap::const_iterator begin() const {
+		return chunks.begin();
+	}
+
+	ChunkMap::const_iterator end() const {
+		return chunks.end();
+	}
+
+private:
+	ChunkMap chunks;
+};
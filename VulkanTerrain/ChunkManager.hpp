@@ -0,0 +1,212 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <unordered_set>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "Chunk.hpp"
+#include "ChunkCache.hpp"
+
+// Inclusive range of chunk grid coordinates
+struct ChunkBox {
+	glm::ivec3 min;
+	glm::ivec3 max;
+
+	bool empty() const {
+		return glm::any(glm::greaterThan(min, max));
+	}
+
+	bool contains(glm::ivec3 p) const {
+		return glm::all(glm::greaterThanEqual(p, min)) && glm::all(glm::lessThanEqual(p, max));
+	}
+
+	ChunkBox intersect(const ChunkBox &other) const {
+		return { glm::max(min, other.min), glm::min(max, other.max) };
+	}
+
+	// Splits this box minus other into at most 6 disjoint boxes
+	void subtract(const ChunkBox &other, std::vector<ChunkBox> &result) const {
+		ChunkBox overlap = intersect(other);
+		if (overlap.empty()) {
+			result.push_back(*this);
+			return;
+		}
+		ChunkBox rest = *this;
+		for (int axis = 0; axis < 3; ++axis) {
+			if (rest.min[axis] < overlap.min[axis]) {
+				ChunkBox slab = rest;
+				slab.max[axis] = overlap.min[axis] - 1;
+				result.push_back(slab);
+				rest.min[axis] = overlap.min[axis];
+			}
+			if (rest.max[axis] > overlap.max[axis]) {
+				ChunkBox slab = rest;
+				slab.min[axis] = overlap.max[axis] + 1;
+				result.push_back(slab);
+				rest.max[axis] = overlap.max[axis];
+			}
+		}
+	}
+
+	template<typename Callback>
+	void forEach(Callback callback) const {
+		for (int x = min.x; x <= max.x; ++x)
+			for (int y = min.y; y <= max.y; ++y)
+				for (int z = min.z; z <= max.z; ++z)
+					callback(glm::ivec3(x, y, z));
+	}
+};
+
+// Chunks that changed since the previous ChunkManager::update, positions are in world space
+struct ChunkUpdate {
+	// Entered the window
+	std::vector<Chunk> add;
+	// Left the window
+	std::vector<glm::ivec3> remove;
+	// Still in the window but need to be remeshed with a new level of detail or seams
+	std::vector<Chunk> refine;
+
+	void clear() {
+		add.clear();
+		remove.clear();
+		refine.clear();
+	}
+};
+
+// Nested clipmap rings centered on the camera chunk. Each ring of lodRingWidth chunks halves the
+// resolution, up to Chunk::MAX_LOD. Moving the window only visits the chunks that actually changed:
+// the slabs entering and leaving the window and the shells around each level of detail boundary
+class ChunkManager {
+public:
+	// extent is the number of chunks on either side of the center along each axis
+	ChunkManager(glm::ivec3 extent, uint32_t lodRingWidth) : extent(extent), lodRingWidth(lodRingWidth) {}
+
+	// Moves the window to the chunk containing worldPosition. Returns false if it didn't move
+	bool update(glm::vec3 worldPosition, ChunkUpdate &changes) {
+		glm::ivec3 newCenter = glm::ivec3(glm::floor(worldPosition / (float)Chunk::CHUNK_SIZE));
+		if (initialized && newCenter == center)
+			return false;
+
+		ChunkBox newWindow = window(newCenter);
+		if (!initialized) {
+			newWindow.forEach([&](glm::ivec3 p) {
+				changes.add.push_back(makeChunk(p, newCenter));
+			});
+			center = newCenter;
+			initialized = true;
+			return true;
+		}
+
+		glm::ivec3 oldCenter = center;
+		ChunkBox oldWindow = window(oldCenter);
+
+		std::vector<ChunkBox> boxes;
+		oldWindow.subtract(newWindow, boxes);
+		for (auto &box : boxes)
+			box.forEach([&](glm::ivec3 p) {
+				changes.remove.push_back(p * (int)Chunk::CHUNK_SIZE);
+			});
+
+		boxes.clear();
+		newWindow.subtract(oldWindow, boxes);
+		for (auto &box : boxes)
+			box.forEach([&](glm::ivec3 p) {
+				changes.add.push_back(makeChunk(p, newCenter));
+			});
+
+		// A chunk changes level when it crosses one of the ring boundaries, its seams change when
+		// it or a neighbour does. Only the shells between the old and new boundaries, grown by one
+		// chunk for the neighbours, have to be checked
+		std::unordered_set<glm::ivec3, ChunkHash> candidates;
+		ChunkBox kept = oldWindow.intersect(newWindow);
+		for (uint32_t lod = 1; lod <= Chunk::MAX_LOD; ++lod) {
+			int radius = (int)(lod * lodRingWidth) - 1;
+			ChunkBox oldRing = { oldCenter - radius, oldCenter + radius };
+			ChunkBox newRing = { newCenter - radius, newCenter + radius };
+			boxes.clear();
+			oldRing.subtract(newRing, boxes);
+			newRing.subtract(oldRing, boxes);
+			for (auto &box : boxes) {
+				ChunkBox grown = ChunkBox{ box.min - 1, box.max + 1 }.intersect(kept);
+				if (!grown.empty())
+					grown.forEach([&](glm::ivec3 p) { candidates.insert(p); });
+			}
+		}
+		for (auto &p : candidates) {
+			if (getLod(p, oldCenter) != getLod(p, newCenter) || getSeamFaces(p, oldCenter) != getSeamFaces(p, newCenter) ||
+				getSkirtFaces(p, oldCenter) != getSkirtFaces(p, newCenter))
+				changes.refine.push_back(makeChunk(p, newCenter));
+		}
+
+		center = newCenter;
+		return true;
+	}
+
+	// Chunk grid position of the window center
+	glm::ivec3 getCenter() const {
+		return center;
+	}
+
+	// True if the chunk at worldPosition lies within margin chunks of the window
+	bool isNearWindow(glm::ivec3 worldPosition, int margin) const {
+		ChunkBox box = window(center);
+		box.min -= margin;
+		box.max += margin;
+		return box.contains(worldPosition / (int)Chunk::CHUNK_SIZE);
+	}
+
+private:
+	glm::ivec3 extent;
+	uint32_t lodRingWidth;
+	glm::ivec3 center;
+	bool initialized = false;
+
+	// Indexed by Chunk::Face
+	const glm::ivec3 faceNormals[6] = {
+		glm::ivec3(-1, 0, 0), glm::ivec3(1, 0, 0),
+		glm::ivec3(0, -1, 0), glm::ivec3(0, 1, 0),
+		glm::ivec3(0, 0, -1), glm::ivec3(0, 0, 1)
+	};
+
+	ChunkBox window(glm::ivec3 windowCenter) const {
+		return { windowCenter - extent, windowCenter + extent };
+	}
+
+	// Rings are measured in chunks, neighbouring chunks never differ by more than one level
+	uint32_t getLod(glm::ivec3 p, glm::ivec3 windowCenter) const {
+		glm::ivec3 offset = glm::abs(p - windowCenter);
+		uint32_t ring = (uint32_t)std::max(std::max(offset.x, offset.y), offset.z);
+		uint32_t lod = ring / lodRingWidth;
+		return lod < Chunk::MAX_LOD ? lod : Chunk::MAX_LOD;
+	}
+
+	uint32_t getSeamFaces(glm::ivec3 p, glm::ivec3 windowCenter) const {
+		uint32_t lod = getLod(p, windowCenter);
+		uint32_t seamFaces = 0;
+		for (uint32_t face = 0; face < 6; ++face)
+			if (getLod(p + faceNormals[face], windowCenter) > lod)
+				seamFaces |= 1 << face;
+		return seamFaces;
+	}
+
+	// Both sides of a level of detail boundary get a skirt, either one may be the one in front
+	uint32_t getSkirtFaces(glm::ivec3 p, glm::ivec3 windowCenter) const {
+		uint32_t lod = getLod(p, windowCenter);
+		uint32_t skirtFaces = 0;
+		for (uint32_t face = 0; face < 6; ++face)
+			if (getLod(p + faceNormals[face], windowCenter) != lod)
+				skirtFaces |= 1 << face;
+		return skirtFaces;
+	}
+
+	Chunk makeChunk(glm::ivec3 p, glm::ivec3 windowCenter) const {
+		Chunk chunk(p * (int)Chunk::CHUNK_SIZE);
+		chunk.lod = getLod(p, windowCenter);
+		chunk.seamFaces = getSeamFaces(p, windowCenter);
+		chunk.skirtFaces = getSkirtFaces(p, windowCenter);
+		return chunk;
+	}
+};
@@ -0,0 +1,343 @@
+#include "CpuMesher.h"
+
+#include <algorithm>
+
+#include "ChunkCache.hpp"
+#include "SimdNoise.h"
+#include "MarchingCubesLookup.h"
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define MESHER_AVX2
+#endif
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define MESHER_SSE2
+#endif
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+// Every row of samples is classified into a single 64 bit mask
+static_assert(Chunk::CHUNK_SIZE < 64, "CpuMesher supports chunks of up to 63 cells");
+
+// Lookup tables of BuildMesh.comp, corners and edges are numbered the same way
+static const glm::ivec3 vertToTexcoord[8] = {
+	glm::ivec3(0, 0, 0), glm::ivec3(0, 1, 0), glm::ivec3(1, 1, 0), glm::ivec3(1, 0, 0),
+	glm::ivec3(0, 0, 1), glm::ivec3(0, 1, 1), glm::ivec3(1, 1, 1), glm::ivec3(1, 0, 1)
+};
+
+// Cell owning the vertex of an edge relative to the cell using it, and the axis of the edge
+static const glm::ivec3 edgeOwner[12] = {
+	glm::ivec3(0, 0, 0), glm::ivec3(0, 1, 0), glm::ivec3(1, 0, 0), glm::ivec3(0, 0, 0),
+	glm::ivec3(0, 0, 1), glm::ivec3(0, 1, 1), glm::ivec3(1, 0, 1), glm::ivec3(0, 0, 1),
+	glm::ivec3(0, 0, 0), glm::ivec3(0, 1, 0), glm::ivec3(1, 1, 0), glm::ivec3(1, 0, 0)
+};
+
+static const int edgeAxis[12] = {
+	1, 0, 1, 0, 1, 0, 1, 0, 2, 2, 2, 2
+};
+
+// Corners of each face of a cell in order around the face and the edges between them,
+// edge i connects corners i and i + 1. Faces are ordered like Chunk::Face
+static const glm::ivec4 faceCorners[6] = {
+	glm::ivec4(0, 1, 5, 4), glm::ivec4(3, 2, 6, 7),
+	glm::ivec4(0, 3, 7, 4), glm::ivec4(1, 2, 6, 5),
+	glm::ivec4(0, 1, 2, 3), glm::ivec4(4, 5, 6, 7)
+};
+static const glm::ivec4 faceEdges[6] = {
+	glm::ivec4(0, 9, 4, 8), glm::ivec4(2, 10, 6, 11),
+	glm::ivec4(3, 11, 7, 8), glm::ivec4(1, 10, 5, 9),
+	glm::ivec4(0, 1, 2, 3), glm::ivec4(4, 5, 6, 7)
+};
+
+// Whether the edge leading away from the sample along axis lies in one of the chunk's skirt faces
+static bool onSkirtFace(uint32_t skirtFaces, int cellCount, glm::ivec3 pos, int axis) {
+	for (int face = 0; face < 6; ++face) {
+		int faceAxis = face / 2;
+		int plane = (face & 1) != 0 ? cellCount : 0;
+		if (faceAxis != axis && pos[faceAxis] == plane && (skirtFaces & (1u << face)) != 0)
+			return true;
+	}
+	return false;
+}
+
+// Outline of the surface on the cell's skirt faces as pairs of edges, see skirtSegments in BuildMesh.comp
+static uint32_t skirtSegments(uint32_t skirtFaces, int cellCount, glm::ivec3 cell, uint32_t caseID, glm::ivec2 segments[6]) {
+	uint32_t count = 0;
+	for (int face = 0; face < 6; ++face) {
+		int axis = face / 2;
+		int plane = (face & 1) != 0 ? cellCount - 1 : 0;
+		if ((skirtFaces & (1u << face)) == 0 || cell[axis] != plane)
+			continue;
+		glm::ivec4 edges = faceEdges[face];
+		bool inside[4];
+		for (int i = 0; i < 4; ++i)
+			inside[i] = ((caseID >> faceCorners[face][i]) & 1) != 0;
+		int crossing[4];
+		int crossingCount = 0;
+		for (int i = 0; i < 4; ++i)
+			if (inside[i] != inside[(i + 1) % 4])
+				crossing[crossingCount++] = edges[i];
+		if (crossingCount == 2)
+			segments[count++] = glm::ivec2(crossing[0], crossing[1]);
+		else if (crossingCount == 4 && inside[0]) {
+			segments[count++] = glm::ivec2(edges[3], edges[0]);
+			segments[count++] = glm::ivec2(edges[1], edges[2]);
+		}
+		else if (crossingCount == 4) {
+			segments[count++] = glm::ivec2(edges[0], edges[1]);
+			segments[count++] = glm::ivec2(edges[2], edges[3]);
+		}
+	}
+	return count;
+}
+
+static uint32_t lowestBit(uint64_t mask) {
+#if defined(_MSC_VER)
+	unsigned long index;
+	_BitScanForward64(&index, mask);
+	return index;
+#else
+	return __builtin_ctzll(mask);
+#endif
+}
+
+// Bit x is set where row[x] lies inside the terrain
+static uint64_t insideMask(const float *row, uint32_t count) {
+	uint64_t mask = 0;
+	uint32_t x = 0;
+#if defined(MESHER_AVX2)
+	__m256 zero8 = _mm256_setzero_ps();
+	for (; x + 8 <= count; x += 8)
+		mask |= (uint64_t)_mm256_movemask_ps(_mm256_cmp_ps(_mm256_loadu_ps(row + x), zero8, _CMP_GT_OQ)) << x;
+#endif
+#if defined(MESHER_SSE2)
+	__m128 zero4 = _mm_setzero_ps();
+	for (; x + 4 <= count; x += 4)
+		mask |= (uint64_t)_mm_movemask_ps(_mm_cmpgt_ps(_mm_loadu_ps(row + x), zero4)) << x;
+#endif
+	for (; x < count; ++x)
+		if (row[x] > 0.0f)
+			mask |= 1ull << x;
+	return mask;
+}
+
+// Density samples of a chunk with a margin of one sample for the normals, x is the innermost axis
+class DensityGrid {
+public:
+	DensityGrid(const Chunk &chunk) : chunk(chunk) {
+		stride = 1 << chunk.lod;
+		cellCount = Chunk::CHUNK_SIZE / stride;
+		size = cellCount + 3;
+		samples.resize(size * size * size);
+		glm::vec3 origin = glm::vec3(chunk.worldPosition - stride) + glm::vec3(0.0f, 16.0f, 0.0f);
+		Density::terrainBlock(origin, (float)stride, glm::ivec3(size), samples.data());
+		snapSeams();
+	}
+
+	float operator[](glm::ivec3 pos) const {
+		return samples[index(pos)];
+	}
+
+	// Samples along x starting at pos
+	const float *row(glm::ivec3 pos) const {
+		return &samples[index(pos)];
+	}
+
+	glm::vec3 gradient(glm::ivec3 pos) const {
+		return glm::vec3(
+			(*this)[pos + glm::ivec3(1, 0, 0)] - (*this)[pos - glm::ivec3(1, 0, 0)],
+			(*this)[pos + glm::ivec3(0, 1, 0)] - (*this)[pos - glm::ivec3(0, 1, 0)],
+			(*this)[pos + glm::ivec3(0, 0, 1)] - (*this)[pos - glm::ivec3(0, 0, 1)]);
+	}
+
+	int stride;
+	int cellCount;
+
+private:
+	const Chunk &chunk;
+	int size;
+	std::vector<float> samples;
+
+	size_t index(glm::ivec3 pos) const {
+		return ((size_t)(pos.z + 1) * size + (pos.y + 1)) * size + (pos.x + 1);
+	}
+
+	// Samples on a face bordering a coarser chunk are interpolated from the coarser lattice, see sampleDensity
+	// in BuildMesh.comp. The coarse samples lie on even coordinates, which are never snapped themselves.
+	// The margin of the face is snapped as well, the normals along the seam are taken from it
+	void snapSeams() {
+		if (chunk.seamFaces == 0)
+			return;
+		std::vector<std::pair<size_t, float>> snapped;
+		for (int z = -1; z <= cellCount + 1; ++z)
+			for (int y = -1; y <= cellCount + 1; ++y)
+				for (int x = -1; x <= cellCount + 1; ++x) {
+					glm::ivec3 pos(x, y, z);
+					glm::ivec3 lower = pos;
+					glm::ivec3 upper = pos;
+					for (int axis = 0; axis < 3; ++axis) {
+						bool onSeam = (pos[axis] == 0 && (chunk.seamFaces & (1u << (2 * axis))) != 0) ||
+							(pos[axis] == cellCount && (chunk.seamFaces & (1u << (2 * axis + 1))) != 0);
+						if (!onSeam)
+							continue;
+						for (int other = 0; other < 3; ++other) {
+							if (other != axis && (pos[other] & 1) != 0) {
+								lower[other] = pos[other] - 1;
+								upper[other] = pos[other] + 1;
+							}
+						}
+					}
+					if (lower == upper)
+						continue;
+
+					// Samples past the margin are clamped to it, like rawDensity does
+					lower = glm::max(lower, glm::ivec3(-1));
+					upper = glm::min(upper, glm::ivec3(cellCount + 1));
+					float sum = 0.0f;
+					for (int i = 0; i < 8; ++i)
+						sum += (*this)[glm::ivec3((i & 1) ? upper.x : lower.x, (i & 2) ? upper.y : lower.y, (i & 4) ? upper.z : lower.z)];
+					snapped.push_back({ index(pos), sum / 8.0f });
+				}
+		for (auto &sample : snapped)
+			samples[sample.first] = sample.second;
+	}
+};
+
+CpuMesher::CpuMesher(uint32_t threadCount)
+	: pool(threadCount != 0 ? threadCount : std::max(std::thread::hardware_concurrency(), 2u) - 1) {
+}
+
+std::future<ChunkMesh> CpuMesher::enqueue(const Chunk &chunk) {
+	return pool.enqueue([chunk] {
+		ChunkMesh mesh;
+		generate(chunk, mesh);
+		return mesh;
+	});
+}
+
+void CpuMesher::generate(const Chunk &chunk, ChunkMesh &mesh) {
+	mesh.vertices.clear();
+	mesh.indices.clear();
+
+	DensityGrid grid(chunk);
+	int cellCount = grid.cellCount;
+	int sampleCount = cellCount + 1;
+	uint64_t sampleBits = (1ull << sampleCount) - 1;
+	uint64_t cellBits = (1ull << cellCount) - 1;
+
+	// One bit per sample of each row, set inside the terrain
+	std::vector<uint64_t> masks(sampleCount * sampleCount);
+	uint64_t anyInside = 0;
+	uint64_t allInside = sampleBits;
+	for (int z = 0; z < sampleCount; ++z)
+		for (int y = 0; y < sampleCount; ++y) {
+			uint64_t mask = insideMask(grid.row(glm::ivec3(0, y, z)), sampleCount);
+			masks[z * sampleCount + y] = mask;
+			anyInside |= mask;
+			allInside &= mask;
+		}
+	mesh.contents = (anyInside != 0 ? CONTENTS_SOLID : 0) | (allInside != sampleBits ? CONTENTS_EMPTY : 0);
+
+	// Vertex of each edge owned by a sample, indexed by axis, and the skirt vertex below it on skirt faces
+	std::vector<uint32_t> edgeVertices[3];
+	std::vector<uint32_t> skirtVertices[3];
+	for (int axis = 0; axis < 3; ++axis) {
+		edgeVertices[axis].resize(sampleCount * sampleCount * sampleCount);
+		skirtVertices[axis].resize(sampleCount * sampleCount * sampleCount);
+	}
+
+	// Same as writeVertex in BuildMesh.comp, the vertex on the edge leading away from the sample at pos along axis
+	auto generateVertex = [&](glm::ivec3 pos, int axis) {
+		glm::ivec3 direction(0);
+		direction[axis] = 1;
+		float vertDensity1 = grid[pos];
+		float vertDensity2 = grid[pos + direction];
+
+		float percentToMove = glm::clamp(vertDensity1 / (vertDensity1 - vertDensity2), 0.0f, 1.0f);
+		glm::vec3 vertex = glm::vec3(pos) + glm::vec3(direction) * percentToMove;
+		glm::vec3 gradient = glm::mix(grid.gradient(pos), grid.gradient(pos + direction), percentToMove);
+		glm::vec3 worldPosition = vertex * (float)grid.stride + glm::vec3(chunk.worldPosition);
+		glm::vec3 normal = -glm::normalize(gradient);
+
+		Vertex v = {
+			{ worldPosition.x, worldPosition.y, worldPosition.z, 1.0f },
+			{ normal.x, normal.y, normal.z, 1.0f }
+		};
+		size_t sample = (pos.z * sampleCount + pos.y) * sampleCount + pos.x;
+		edgeVertices[axis][sample] = (uint32_t)mesh.vertices.size();
+		mesh.vertices.push_back(v);
+
+		if (onSkirtFace(chunk.skirtFaces, cellCount, pos, axis)) {
+			glm::vec3 skirtPosition = worldPosition - normal * (float)(2 * grid.stride);
+			Vertex skirt = {
+				{ skirtPosition.x, skirtPosition.y, skirtPosition.z, 1.0f },
+				{ normal.x, normal.y, normal.z, 1.0f }
+			};
+			skirtVertices[axis][sample] = (uint32_t)mesh.vertices.size();
+			mesh.vertices.push_back(skirt);
+		}
+	};
+
+	auto cellVertex = [&](glm::ivec3 cell, int32_t edge, bool skirt) {
+		glm::ivec3 owner = cell + edgeOwner[edge];
+		size_t sample = (owner.z * sampleCount + owner.y) * sampleCount + owner.x;
+		return skirt ? skirtVertices[edgeAxis[edge]][sample] : edgeVertices[edgeAxis[edge]][sample];
+	};
+
+	// Vertices on every edge whose end points lie on different sides of the surface. Like a single invocation
+	// of the vertex pass after another, samples in order and the edges of a sample along x, y and z
+	for (int z = 0; z < sampleCount; ++z)
+		for (int y = 0; y < sampleCount; ++y) {
+			uint64_t row = masks[z * sampleCount + y];
+			uint64_t crossings[3] = {
+				(row ^ (row >> 1)) & cellBits,
+				y < cellCount ? (row ^ masks[z * sampleCount + y + 1]) & sampleBits : 0,
+				z < cellCount ? (row ^ masks[(z + 1) * sampleCount + y]) & sampleBits : 0
+			};
+			for (uint64_t bits = crossings[0] | crossings[1] | crossings[2]; bits != 0; bits &= bits - 1) {
+				uint32_t x = lowestBit(bits);
+				for (int axis = 0; axis < 3; ++axis)
+					if ((crossings[axis] >> x) & 1)
+						generateVertex(glm::ivec3(x, y, z), axis);
+			}
+		}
+
+	// Triangles of every cell that isn't completely inside or outside
+	for (int z = 0; z < cellCount; ++z)
+		for (int y = 0; y < cellCount; ++y) {
+			uint64_t corners[8];
+			uint64_t any = 0;
+			uint64_t all = ~0ull;
+			for (int i = 0; i < 8; ++i) {
+				glm::ivec3 offset = vertToTexcoord[i];
+				corners[i] = masks[(z + offset.z) * sampleCount + y + offset.y] >> offset.x;
+				any |= corners[i];
+				all &= corners[i];
+			}
+
+			for (uint64_t bits = any & ~all & cellBits; bits != 0; bits &= bits - 1) {
+				uint32_t x = lowestBit(bits);
+				uint32_t caseID = 0;
+				for (int i = 0; i < 8; ++i)
+					caseID |= (uint32_t)((corners[i] >> x) & 1) << i;
+
+				glm::ivec3 cell(x, y, z);
+				for (uint32_t t = 0; triTable[caseID][t] != -1; t += 3)
+					for (uint32_t i = 0; i < 3; ++i)
+						mesh.indices.push_back(cellVertex(cell, triTable[caseID][t + i], false));
+
+				// Each segment of the outline on a skirt face is extended by a quad into the terrain
+				glm::ivec2 segments[6];
+				uint32_t segmentCount = chunk.skirtFaces != 0 ? skirtSegments(chunk.skirtFaces, cellCount, cell, caseID, segments) : 0;
+				for (uint32_t s = 0; s < segmentCount; ++s) {
+					uint32_t quad[6] = {
+						cellVertex(cell, segments[s].x, false), cellVertex(cell, segments[s].y, false), cellVertex(cell, segments[s].y, true),
+						cellVertex(cell, segments[s].x, false), cellVertex(cell, segments[s].y, true), cellVertex(cell, segments[s].x, true)
+					};
+					mesh.indices.insert(mesh.indices.end(), quad, quad + 6);
+				}
+			}
+		}
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <future>
+#include <vector>
+
+#include "Chunk.hpp"
+#include "ThreadPool.hpp"
+#include "Vertex.hpp"
+
+// Indexed triangle mesh of a single chunk in world space
+struct ChunkMesh {
+	std::vector<Vertex> vertices;
+	std::vector<uint32_t> indices;
+	// ChunkContents of the chunk's samples
+	uint32_t contents = 0;
+};
+
+// Host implementation of BuildMesh.comp. Chunks are meshed with the same density function, level of detail
+// strides, seams and lookup tables, so it can stand in for the GPU mesher or be used to validate it
+class CpuMesher {
+public:
+	// 0 uses all hardware threads but one, which is left to the render thread
+	CpuMesher(uint32_t threadCount = 0);
+
+	// Meshes the chunk on one of the worker threads
+	std::future<ChunkMesh> enqueue(const Chunk &chunk);
+
+	// Meshes the chunk on the calling thread
+	static void generate(const Chunk &chunk, ChunkMesh &mesh);
+
+private:
+	ThreadPool pool;
+};
@@ -0,0 +1,150 @@
+#pragma once
+
+#include <glm/glm.hpp>
+
+// Multiplies and adds are never fused, for the rest of every file including this one. SimdNoise.cpp does the
+// same, otherwise the two may be contracted differently and drift apart by up to a few hundredths.
+// GCC ignores the pragma and needs -ffp-contract=off
+#if defined(_MSC_VER)
+#pragma fp_contract(off)
+#elif defined(__clang__)
+#pragma STDC FP_CONTRACT OFF
+#endif
+
+// Host side copy of the terrain density function in Density.comp, the two have to be kept in sync.
+// Positive density is solid ground
+namespace Density {
+	inline glm::vec3 mod289(glm::vec3 x) {
+		return x - glm::floor(x * (1.0f / 289.0f)) * 289.0f;
+	}
+
+	inline glm::vec4 mod289(glm::vec4 x) {
+		return x - glm::floor(x * (1.0f / 289.0f)) * 289.0f;
+	}
+
+	inline glm::vec4 permute(glm::vec4 x) {
+		return mod289(((x * 34.0f) + 1.0f) * x);
+	}
+
+	inline glm::vec4 taylorInvSqrt(glm::vec4 r) {
+		return 1.79284291400159f - 0.85373472095314f * r;
+	}
+
+	// Simplex noise, see snoise in Density.comp
+	inline float snoise(glm::vec3 v) {
+		const glm::vec2 C = glm::vec2(1.0f / 6.0f, 1.0f / 3.0f);
+		const glm::vec4 D = glm::vec4(0.0f, 0.5f, 1.0f, 2.0f);
+
+		// First corner
+		glm::vec3 i = glm::floor(v + glm::dot(v, glm::vec3(C.y)));
+		glm::vec3 x0 = v - i + glm::dot(i, glm::vec3(C.x));
+
+		// Other corners
+		glm::vec3 g = glm::step(glm::vec3(x0.y, x0.z, x0.x), x0);
+		glm::vec3 l = 1.0f - g;
+		glm::vec3 i1 = glm::min(g, glm::vec3(l.z, l.x, l.y));
+		glm::vec3 i2 = glm::max(g, glm::vec3(l.z, l.x, l.y));
+
+		glm::vec3 x1 = x0 - i1 + C.x;
+		glm::vec3 x2 = x0 - i2 + C.y;
+		glm::vec3 x3 = x0 - D.y;
+
+		// Permutations
+		i = mod289(i);
+		glm::vec4 p = permute(permute(permute(
+			i.z + glm::vec4(0.0f, i1.z, i2.z, 1.0f))
+			+ i.y + glm::vec4(0.0f, i1.y, i2.y, 1.0f))
+			+ i.x + glm::vec4(0.0f, i1.x, i2.x, 1.0f));
+
+		// Gradients: 7x7 points over a square, mapped onto an octahedron
+		float n_ = 0.142857142857f;
+		glm::vec3 ns = n_ * glm::vec3(D.w, D.y, D.z) - glm::vec3(D.x, D.z, D.x);
+
+		glm::vec4 j = p - 49.0f * glm::floor(p * ns.z * ns.z);
+
+		glm::vec4 x_ = glm::floor(j * ns.z);
+		glm::vec4 y_ = glm::floor(j - 7.0f * x_);
+
+		glm::vec4 x = x_ * ns.x + ns.y;
+		glm::vec4 y = y_ * ns.x + ns.y;
+		glm::vec4 h = 1.0f - glm::abs(x) - glm::abs(y);
+
+		glm::vec4 b0 = glm::vec4(x.x, x.y, y.x, y.y);
+		glm::vec4 b1 = glm::vec4(x.z, x.w, y.z, y.w);
+
+		glm::vec4 s0 = glm::floor(b0) * 2.0f + 1.0f;
+		glm::vec4 s1 = glm::floor(b1) * 2.0f + 1.0f;
+		glm::vec4 sh = -glm::step(h, glm::vec4(0.0f));
+
+		glm::vec4 a0 = glm::vec4(b0.x, b0.z, b0.y, b0.w) + glm::vec4(s0.x, s0.z, s0.y, s0.w) * glm::vec4(sh.x, sh.x, sh.y, sh.y);
+		glm::vec4 a1 = glm::vec4(b1.x, b1.z, b1.y, b1.w) + glm::vec4(s1.x, s1.z, s1.y, s1.w) * glm::vec4(sh.z, sh.z, sh.w, sh.w);
+
+		glm::vec3 p0 = glm::vec3(a0.x, a0.y, h.x);
+		glm::vec3 p1 = glm::vec3(a0.z, a0.w, h.y);
+		glm::vec3 p2 = glm::vec3(a1.x, a1.y, h.z);
+		glm::vec3 p3 = glm::vec3(a1.z, a1.w, h.w);
+
+		// Normalise gradients
+		glm::vec4 norm = taylorInvSqrt(glm::vec4(glm::dot(p0, p0), glm::dot(p1, p1), glm::dot(p2, p2), glm::dot(p3, p3)));
+		p0 *= norm.x;
+		p1 *= norm.y;
+		p2 *= norm.z;
+		p3 *= norm.w;
+
+		// Mix final noise value
+		glm::vec4 m = glm::max(0.6f - glm::vec4(glm::dot(x0, x0), glm::dot(x1, x1), glm::dot(x2, x2), glm::dot(x3, x3)), 0.0f);
+		m = m * m;
+		return 42.0f * glm::dot(m * m, glm::vec4(glm::dot(p0, x0), glm::dot(p1, x1), glm::dot(p2, x2), glm::dot(p3, x3)));
+	}
+
+	// Upper bound of abs(snoise(v)), the gradients can push it slightly past 1
+	const float SNOISE_BOUND = 1.1f;
+
+	// Part of terrain() that only depends on the height, falls monotonically with y
+	inline float heightDensity(float y) {
+		float density = -y;
+
+		// Flat zones
+		density += glm::clamp(35.0f - y, 0.0f, 1.0f) * 10.0f;
+		density += glm::clamp(30.0f - y, 0.0f, 1.0f) * 20.0f;
+		density += glm::clamp(20.0f - y, 0.0f, 1.0f) * 10.0f;
+		density += glm::clamp(10.0f - y, 0.0f, 1.0f) * 5.0f;
+		density += glm::clamp(3.0f - y, 0.0f, 1.0f) * 10.0f;
+		return density;
+	}
+
+	// Density of the terrain at a point in world space, see density in Density.comp
+	inline float terrain(glm::vec3 worldPoint) {
+		float density = heightDensity(worldPoint.y);
+
+		const float angle = 0.9f;
+		const glm::mat3 rotationMatrix = glm::mat3(
+			cos(angle), -sin(angle), 0.0f,
+			sin(angle), cos(angle), 0.0f,
+			0.0f, 0.0f, 0.0f);
+
+		// Domain warp
+		worldPoint += 60.0f * snoise(worldPoint * 0.0035f);
+		worldPoint += 120.0f * snoise(worldPoint * 0.0015f);
+		worldPoint += 240.0f * snoise(worldPoint * 0.0007f);
+
+		density += 0.25f * snoise(rotationMatrix * worldPoint * 0.401f);
+		density += 0.5f * snoise(rotationMatrix * worldPoint * 0.193f);
+		density += 1.0f * snoise(worldPoint * 0.101f);
+		density += 2.0f * snoise(worldPoint * 0.049f);
+		density += 4.0f * snoise(worldPoint * 0.022f);
+		density += 8.0f * snoise(worldPoint * 0.01f);
+		density += 16.0f * snoise(worldPoint * 0.0051f);
+		density += 24.0f * snoise(worldPoint * 0.0023f);
+		density += 48.0f * snoise(worldPoint * 0.0009f);
+
+		return density;
+	}
+
+	// Range of terrain() over all points with a height in [minY, maxY]. The domain warp only moves the points
+	// the noise is evaluated at, so the octaves add at most the sum of their amplitudes
+	inline glm::vec2 terrainBounds(float minY, float maxY) {
+		const float noiseAmplitude = (0.25f + 0.5f + 1.0f + 2.0f + 4.0f + 8.0f + 16.0f + 24.0f + 48.0f) * SNOISE_BOUND;
+		return glm::vec2(heightDensity(maxY) - noiseAmplitude, heightDensity(minY) + noiseAmplitude);
+	}
+}
@@ -0,0 +1,81 @@
+#pragma once
+
+#include <cstdint>
+#include <iterator>
+#include <list>
+#include <unordered_map>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "ChunkCache.hpp"
+
+// Bricks of the density atlas holding the density fields of recently generated chunks, keyed by
+// Chunk::worldPosition and level of detail. Chunks that are meshed again find their densities here
+// instead of evaluating the noise, the least recently used brick is reused for new chunks
+class DensityCache {
+public:
+	static const uint32_t NO_BRICK = UINT32_MAX;
+
+	DensityCache(uint32_t brickCount = 0) {
+		reset(brickCount);
+	}
+
+	// Forgets every chunk, all bricks are free afterwards
+	void reset(uint32_t brickCount) {
+		bricks.clear();
+		order.clear();
+		freeBricks.clear();
+		for (uint32_t brick = brickCount; brick > 0; --brick)
+			freeBricks.push_back(brick - 1);
+	}
+
+	// Returns the brick holding the chunk's densities or NO_BRICK, found chunks become the most recently used
+	uint32_t find(glm::ivec3 worldPosition, uint32_t lod) {
+		auto it = bricks.find(glm::ivec4(worldPosition, lod));
+		if (it == bricks.end())
+			return NO_BRICK;
+		order.splice(order.end(), order, it->second.use);
+		return it->second.brick;
+	}
+
+	// Assigns a brick to a chunk that isn't cached yet, evicting the least recently used chunk if none is free
+	uint32_t insert(glm::ivec3 worldPosition, uint32_t lod) {
+		uint32_t brick;
+		if (!freeBricks.empty()) {
+			brick = freeBricks.back();
+			freeBricks.pop_back();
+		}
+		else {
+			auto evicted = bricks.find(order.front());
+			brick = evicted->second.brick;
+			bricks.erase(evicted);
+			order.pop_front();
+		}
+		glm::ivec4 key(worldPosition, lod);
+		order.push_back(key);
+		bricks[key] = { brick, std::prev(order.end()) };
+		return brick;
+	}
+
+	size_t size() const {
+		return bricks.size();
+	}
+
+private:
+	struct KeyHash {
+		size_t operator()(const glm::ivec4 &key) const {
+			return ChunkHash()(glm::ivec3(key)) ^ ((size_t)key.w * 2654435761u);
+		}
+	};
+
+	struct Entry {
+		uint32_t brick;
+		std::list<glm::ivec4>::iterator use;
+	};
+
+	std::unordered_map<glm::ivec4, Entry, KeyHash> bricks;
+	// Cached chunks from least to most recently used
+	std::list<glm::ivec4> order;
+	std::vector<uint32_t> freeBricks;
+};
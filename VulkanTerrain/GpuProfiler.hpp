@@ -0,0 +1,138 @@
+#pragma once
+
+#include <algorithm>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "vulkan.h"
+#include "base/vulkantools.h"
+
+// GPU time of regions of command buffers, measured with timestamp queries. Command buffers that can be
+// in flight at the same time record into their own set of queries, a set is read back with collect()
+// once the fence of its last submission has signalled
+class GpuProfiler {
+public:
+	// Number of durations per region the statistics are computed from
+	static const size_t HISTORY_SIZE = 256;
+
+	GpuProfiler(VkPhysicalDevice physicalDevice, VkDevice device, uint32_t queueFamilyIndex, uint32_t setCount, const std::vector<std::string> &regionNames)
+		: device(device), setCount(setCount) {
+		uint32_t queueCount;
+		vkGetPhysicalDeviceQueueFamilyProperties(physicalDevice, &queueCount, nullptr);
+		std::vector<VkQueueFamilyProperties> queueProps(queueCount);
+		vkGetPhysicalDeviceQueueFamilyProperties(physicalDevice, &queueCount, queueProps.data());
+		assert(queueFamilyIndex < queueCount);
+
+		// Queues without timestamp support record nothing
+		uint32_t validBits = queueProps[queueFamilyIndex].timestampValidBits;
+		if (validBits == 0)
+			return;
+		timestampMask = validBits >= 64 ? ~0ull : (1ull << validBits) - 1;
+
+		VkPhysicalDeviceProperties properties;
+		vkGetPhysicalDeviceProperties(physicalDevice, &properties);
+		timestampPeriod = properties.limits.timestampPeriod;
+
+		regions.resize(regionNames.size());
+		for (size_t r = 0; r < regions.size(); ++r)
+			regions[r].name = regionNames[r];
+
+		VkQueryPoolCreateInfo queryPoolInfo = {};
+		queryPoolInfo.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+		queryPoolInfo.queryType = VK_QUERY_TYPE_TIMESTAMP;
+		queryPoolInfo.queryCount = setCount * queriesPerSet();
+		vkTools::checkResult(vkCreateQueryPool(device, &queryPoolInfo, nullptr, &queryPool));
+	}
+
+	~GpuProfiler() {
+		if (queryPool != VK_NULL_HANDLE)
+			vkDestroyQueryPool(device, queryPool, nullptr);
+	}
+
+	GpuProfiler(const GpuProfiler &) = delete;
+	GpuProfiler &operator=(const GpuProfiler &) = delete;
+
+	// Has to be recorded outside of a render pass before any region of the set
+	void reset(VkCommandBuffer cmdBuffer, uint32_t set) {
+		if (queryPool != VK_NULL_HANDLE)
+			vkCmdResetQueryPool(cmdBuffer, queryPool, set * queriesPerSet(), queriesPerSet());
+	}
+
+	void begin(VkCommandBuffer cmdBuffer, uint32_t set, uint32_t region) {
+		if (queryPool != VK_NULL_HANDLE)
+			vkCmdWriteTimestamp(cmdBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, queryPool, query(set, region));
+	}
+
+	void end(VkCommandBuffer cmdBuffer, uint32_t set, uint32_t region) {
+		if (queryPool != VK_NULL_HANDLE)
+			vkCmdWriteTimestamp(cmdBuffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, queryPool, query(set, region) + 1);
+	}
+
+	// Adds the durations of the regions recorded in the set, regions that weren't recorded are skipped
+	void collect(uint32_t set) {
+		if (queryPool == VK_NULL_HANDLE)
+			return;
+		// Timestamp and availability of every query
+		std::vector<uint64_t> results(2 * queriesPerSet());
+		VkResult result = vkGetQueryPoolResults(device, queryPool, set * queriesPerSet(), queriesPerSet(),
+			results.size() * sizeof(uint64_t), results.data(), 2 * sizeof(uint64_t),
+			VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WITH_AVAILABILITY_BIT);
+		if (result == VK_NOT_READY)
+			result = VK_SUCCESS;
+		vkTools::checkResult(result);
+
+		for (size_t r = 0; r < regions.size(); ++r) {
+			const uint64_t *timestamps = &results[4 * r];
+			if (timestamps[1] == 0 || timestamps[3] == 0)
+				continue;
+			uint64_t ticks = (timestamps[2] - timestamps[0]) & timestampMask;
+			Region &region = regions[r];
+			double ms = ticks * (double)timestampPeriod / 1000000.0;
+			if (region.history.size() < HISTORY_SIZE)
+				region.history.push_back(ms);
+			else
+				region.history[region.next] = ms;
+			region.next = (region.next + 1) % HISTORY_SIZE;
+		}
+	}
+
+	// Writes min, average and 99th percentile of the recent durations of every region
+	void report(std::ostream &out) const {
+		for (auto &region : regions) {
+			if (region.history.empty())
+				continue;
+			std::vector<double> sorted = region.history;
+			std::sort(sorted.begin(), sorted.end());
+			double sum = 0.0;
+			for (double ms : sorted)
+				sum += ms;
+			size_t p99 = std::min(sorted.size() - 1, sorted.size() * 99 / 100);
+			out << "gpu " << region.name << ": min " << sorted.front() << " ms, avg " << sum / sorted.size()
+				<< " ms, p99 " << sorted[p99] << " ms\n";
+		}
+	}
+
+private:
+	struct Region {
+		std::string name;
+		std::vector<double> history;
+		size_t next = 0;
+	};
+
+	VkDevice device;
+	VkQueryPool queryPool = VK_NULL_HANDLE;
+	uint32_t setCount;
+	uint64_t timestampMask = 0;
+	// Nanoseconds per tick
+	float timestampPeriod = 1.0f;
+	std::vector<Region> regions;
+
+	uint32_t queriesPerSet() const {
+		return 2 * (uint32_t)regions.size();
+	}
+
+	uint32_t query(uint32_t set, uint32_t region) const {
+		return set * queriesPerSet() + 2 * region;
+	}
+};
@@ -4,7 +4,7 @@ VulkanTerrain * app;
 
 LRESULT CALLBACK WndProc(HWND hWnd, UINT uMsg, WPARAM wParam, LPARAM lParam)
 {
-	if (app != NULL)
+	if (app != NULL && app->meshRenderer != NULL)
 	{
 		app->meshRenderer->handleMessages(hWnd, uMsg, wParam, lParam);
 	}
@@ -13,8 +13,11 @@ LRESULT CALLBACK WndProc(HWND hWnd, UINT uMsg, WPARAM wParam, LPARAM lParam)
 
 int APIENTRY WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPSTR pCmdLine, int nCmdShow) {
 	app = new VulkanTerrain(true);
-	app->meshRenderer->winHandle = app->setupWindow(hInstance, WndProc);
-	app->initSwapChain();
+	// Headless runs only generate the terrain, see VulkanTerrain::render
+	if (!app->headless) {
+		app->meshRenderer->winHandle = app->meshRenderer->setupWindow(hInstance, WndProc);
+		app->meshRenderer->initSwapChain();
+	}
 	app->prepare();
 	app->render();
 	delete(app);
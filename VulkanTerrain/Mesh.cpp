@@ -1,7 +1,10 @@
 #include "Mesh.h"
+#include "Chunk.hpp"
 
-Mesh::Mesh(bool enableValidation) : VulkanBase(enableValidation) {
+Mesh::Mesh(VulkanBase *generator) : VulkanBase(generator) {
 	title = "Vulkan Terrain";
+	// Keeps the pipeline cache apart from the one of the terrain generator
+	name = "terrainRenderer";
 
 	cam = new Camera((float)width, (float)height);
 
@@ -36,6 +39,9 @@ void Mesh::buildCommandBuffers() {
 		destroyCommandBuffers();
 		createCommandBuffers();
 	}
+	// One set of queries per swapchain image, read back once the image's fence has signalled
+	if (profile && profiler == nullptr)
+		profiler = new GpuProfiler(physicalDevice, device, queueFamilyIndices.graphics, (uint32_t)drawCmdBuffers.size(), { "cull", "render", "depth pyramid" });
 
 	VkCommandBufferBeginInfo cmdBufInfo = vkTools::initializers::commandBufferBeginInfo();
 
@@ -57,6 +63,48 @@ void Mesh::buildCommandBuffers() {
 
 		vkTools::checkResult(vkBeginCommandBuffer(drawCmdBuffers[i], &cmdBufInfo));
 
+		addPostPresentBarrier(drawCmdBuffers[i], swapChain.buffers[i].image);
+		if (profiler != nullptr)
+			profiler->reset(drawCmdBuffers[i], i);
+
+		// The previous frame may still be drawing from the visible draws
+		vkCmdPipelineBarrier(
+			drawCmdBuffers[i],
+			VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT,
+			VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+			VK_FLAGS_NONE,
+			0, nullptr,
+			0, nullptr,
+			0, nullptr);
+
+		// Cull the chunks against the view frustum before they are drawn
+		if (profiler != nullptr)
+			profiler->begin(drawCmdBuffers[i], i, PROFILE_CULL);
+		vkCmdBindPipeline(drawCmdBuffers[i], VK_PIPELINE_BIND_POINT_COMPUTE, pipelines.cull);
+		vkCmdBindDescriptorSets(drawCmdBuffers[i], VK_PIPELINE_BIND_POINT_COMPUTE, cullPipelineLayout, 0, 1, &cullDescriptorSets[i], 0, NULL);
+		vkCmdDispatch(drawCmdBuffers[i], (meshes.terrain.drawCount + 63) / 64, 1, 1);
+		if (profiler != nullptr)
+			profiler->end(drawCmdBuffers[i], i, PROFILE_CULL);
+
+		VkBufferMemoryBarrier cullBarrier = vkTools::initializers::bufferMemoryBarrier();
+		cullBarrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+		cullBarrier.dstAccessMask = VK_ACCESS_INDIRECT_COMMAND_READ_BIT;
+		cullBarrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+		cullBarrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+		cullBarrier.buffer = meshes.terrain.visibleDraws.buf;
+		cullBarrier.offset = 0;
+		cullBarrier.size = VK_WHOLE_SIZE;
+		vkCmdPipelineBarrier(
+			drawCmdBuffers[i],
+			VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+			VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT,
+			VK_FLAGS_NONE,
+			0, nullptr,
+			1, &cullBarrier,
+			0, nullptr);
+
+		if (profiler != nullptr)
+			profiler->begin(drawCmdBuffers[i], i, PROFILE_RENDER);
 		vkCmdBeginRenderPass(drawCmdBuffers[i], &renderPassBeginInfo, VK_SUBPASS_CONTENTS_INLINE);
 
 		VkViewport viewport = vkTools::initializers::viewport(
@@ -73,31 +121,176 @@ void Mesh::buildCommandBuffers() {
 			0);
 		vkCmdSetScissor(drawCmdBuffers[i], 0, 1, &scissor);
 
-		vkCmdBindDescriptorSets(drawCmdBuffers[i], VK_PIPELINE_BIND_POINT_GRAPHICS, pipelineLayout, 0, 1, &descriptorSetPostCompute, 0, NULL);
+		vkCmdBindDescriptorSets(drawCmdBuffers[i], VK_PIPELINE_BIND_POINT_GRAPHICS, pipelineLayout, 0, 1, &descriptorSetsPostCompute[i], 0, NULL);
 		vkCmdBindPipeline(drawCmdBuffers[i], VK_PIPELINE_BIND_POINT_GRAPHICS, pipelines.render);
 
 		VkDeviceSize offsets[1] = { 0 };
 		vkCmdBindVertexBuffers(drawCmdBuffers[i], 0, 1, &meshes.terrain.vertices.buf, offsets);
 		vkCmdBindIndexBuffer(drawCmdBuffers[i], meshes.terrain.indices.buf, 0, VK_INDEX_TYPE_UINT32);
-		vkCmdDrawIndexed(drawCmdBuffers[i], meshes.terrain.indexCount, 1, 0, 0, 0);
+		// Every chunk is drawn from its own range of the terrain buffers, culled chunks have an empty draw
+		uint32_t visibleStride = sizeof(VkDrawIndexedIndirectCommand);
+		if (enabledFeatures.multiDrawIndirect)
+			vkCmdDrawIndexedIndirect(drawCmdBuffers[i], meshes.terrain.visibleDraws.buf, 0, meshes.terrain.drawCount, visibleStride);
+		else
+			for (uint32_t d = 0; d < meshes.terrain.drawCount; ++d)
+				vkCmdDrawIndexedIndirect(drawCmdBuffers[i], meshes.terrain.visibleDraws.buf, d * visibleStride, 1, visibleStride);
+
+		vkCmdEndRenderPass(drawCmdBuffers[i]);
+		if (profiler != nullptr) {
+			profiler->end(drawCmdBuffers[i], i, PROFILE_RENDER);
+			profiler->begin(drawCmdBuffers[i], i, PROFILE_DEPTH_PYRAMID);
+		}
+
+		// Occluders for the culling pass of the next frame
+		buildDepthPyramid(drawCmdBuffers[i]);
+		if (profiler != nullptr)
+			profiler->end(drawCmdBuffers[i], i, PROFILE_DEPTH_PYRAMID);
+
+		addPrePresentBarrier(drawCmdBuffers[i], swapChain.buffers[i].image);
+
+		vkTools::checkResult(vkEndCommandBuffer(drawCmdBuffers[i]));
 	}
 }
 
+void Mesh::buildDepthPyramid(VkCommandBuffer cmdBuffer) {
+	VkImageMemoryBarrier depthBarrier = vkTools::initializers::imageMemoryBarrier();
+	depthBarrier.srcAccessMask = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+	depthBarrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+	depthBarrier.oldLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+	depthBarrier.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+	depthBarrier.image = depthStencil.image;
+	depthBarrier.subresourceRange = { VK_IMAGE_ASPECT_DEPTH_BIT | VK_IMAGE_ASPECT_STENCIL_BIT, 0, 1, 0, 1 };
+	// The culling pass at the start of the frame still reads the pyramid this overwrites
+	vkCmdPipelineBarrier(
+		cmdBuffer,
+		VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+		VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+		VK_FLAGS_NONE,
+		0, nullptr,
+		0, nullptr,
+		1, &depthBarrier);
+
+	// Each level reduces the one before it, the first level reduces the depth attachment
+	VkMemoryBarrier levelBarrier = vkTools::initializers::memoryBarrier();
+	levelBarrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+	levelBarrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+
+	vkCmdBindPipeline(cmdBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, pipelines.depthPyramid);
+	for (uint32_t level = 0; level < depthPyramid.mipLevels; ++level) {
+		uint32_t levelWidth = std::max(depthPyramid.width >> level, 1u);
+		uint32_t levelHeight = std::max(depthPyramid.height >> level, 1u);
+		vkCmdBindDescriptorSets(cmdBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, depthPyramidPipelineLayout, 0, 1, &depthPyramidDescriptorSets[level], 0, NULL);
+		vkCmdDispatch(cmdBuffer, (levelWidth + 15) / 16, (levelHeight + 15) / 16, 1);
+		vkCmdPipelineBarrier(
+			cmdBuffer,
+			VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+			VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+			VK_FLAGS_NONE,
+			1, &levelBarrier,
+			0, nullptr,
+			0, nullptr);
+	}
+
+	depthBarrier.srcAccessMask = VK_ACCESS_SHADER_READ_BIT;
+	depthBarrier.dstAccessMask = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+	depthBarrier.oldLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+	depthBarrier.newLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+	vkCmdPipelineBarrier(
+		cmdBuffer,
+		VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+		VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT,
+		VK_FLAGS_NONE,
+		0, nullptr,
+		0, nullptr,
+		1, &depthBarrier);
+}
+
+// Records nothing, the command buffers are prebuilt per swapchain image. Up to MAX_FRAMES_IN_FLIGHT
+// frames are queued before the CPU waits for the oldest one
 void Mesh::draw() {
-	vkTools::checkResult(swapChain.acquireNextImage(semaphores.presentComplete, &currentBuffer));
+	FrameSync &frame = frames[currentFrame];
+	vkTools::checkResult(vkWaitForFences(device, 1, &frame.fence, VK_TRUE, UINT64_MAX));
 
-	submitPostPresentBarrier(swapChain.buffers[currentBuffer].image);
+	vkTools::checkResult(swapChain.acquireNextImage(frame.presentComplete, &currentBuffer));
 
-	submitInfo.commandBufferCount = 1;
-	submitInfo.pCommandBuffers = &drawCmdBuffers[currentBuffer];
+	// The image may have been acquired out of order and still be in use by another frame
+	if (imageFences[currentBuffer] != VK_NULL_HANDLE && imageFences[currentBuffer] != frame.fence)
+		vkTools::checkResult(vkWaitForFences(device, 1, &imageFences[currentBuffer], VK_TRUE, UINT64_MAX));
+	// The previous frame rendered into the image has finished, so its timestamps are available
+	if (profiler != nullptr && imageFences[currentBuffer] != VK_NULL_HANDLE)
+		profiler->collect(currentBuffer);
+	imageFences[currentBuffer] = frame.fence;
 
-	vkTools::checkResult(vkQueueSubmit(queue, 1, &submitInfo, VK_NULL_HANDLE));
+	updateUniformBuffers();
+
+	// Changes to the draw table go in ahead of the frame's culling pass
+	std::vector<VkCommandBuffer> commandBuffers;
+	if (!pendingDraws.empty()) {
+		recordDrawUpdates(drawUpdateCmdBuffers[currentFrame]);
+		commandBuffers.push_back(drawUpdateCmdBuffers[currentFrame]);
+	}
+	commandBuffers.push_back(drawCmdBuffers[currentBuffer]);
 
-	submitPrePresentBarrier(swapChain.buffers[currentBuffer].image);
+	submitInfo.pWaitSemaphores = &frame.presentComplete;
+	submitInfo.pSignalSemaphores = &frame.renderComplete;
+	submitInfo.commandBufferCount = commandBuffers.size();
+	submitInfo.pCommandBuffers = commandBuffers.data();
 
-	vkTools::checkResult(swapChain.queuePresent(queue, currentBuffer, semaphores.renderComplete));
+	frameSerials[currentFrame] = ++submittedFrames;
+	vkTools::checkResult(vkResetFences(device, 1, &frame.fence));
+	vkTools::checkResult(vkQueueSubmit(queue, 1, &submitInfo, frame.fence));
 
-	vkTools::checkResult(vkQueueWaitIdle(queue));
+	vkTools::checkResult(swapChain.queuePresent(queue, currentBuffer, frame.renderComplete));
+
+	currentFrame = (currentFrame + 1) % MAX_FRAMES_IN_FLIGHT;
+}
+
+void Mesh::recordDrawUpdates(VkCommandBuffer cmdBuffer) {
+	VkCommandBufferBeginInfo cmdBufInfo = vkTools::initializers::commandBufferBeginInfo();
+	vkTools::checkResult(vkBeginCommandBuffer(cmdBuffer, &cmdBufInfo));
+
+	// Earlier frames may still be culling with the old entries
+	vkCmdPipelineBarrier(
+		cmdBuffer,
+		VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+		VK_PIPELINE_STAGE_TRANSFER_BIT,
+		VK_FLAGS_NONE,
+		0, nullptr,
+		0, nullptr,
+		0, nullptr);
+
+	for (auto &draw : pendingDraws)
+		vkCmdUpdateBuffer(cmdBuffer, meshes.terrain.draws.buf, (VkDeviceSize)draw.first * meshes.terrain.drawStride, meshes.terrain.drawStride, (const uint32_t*)draw.second.data());
+	pendingDraws.clear();
+
+	VkMemoryBarrier updateBarrier = vkTools::initializers::memoryBarrier();
+	updateBarrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+	updateBarrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+	vkCmdPipelineBarrier(
+		cmdBuffer,
+		VK_PIPELINE_STAGE_TRANSFER_BIT,
+		VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+		VK_FLAGS_NONE,
+		1, &updateBarrier,
+		0, nullptr,
+		0, nullptr);
+
+	vkTools::checkResult(vkEndCommandBuffer(cmdBuffer));
+}
+
+void Mesh::updateDraw(uint32_t slot, const void *drawCommand) {
+	assert(slot < meshes.terrain.drawCount);
+	const uint8_t *bytes = (const uint8_t*)drawCommand;
+	pendingDraws[slot].assign(bytes, bytes + meshes.terrain.drawStride);
+}
+
+uint64_t Mesh::completedFrames() {
+	// Frames finish in submission order, so the oldest unfinished frame bounds the result
+	uint64_t completed = submittedFrames;
+	for (uint32_t f = 0; f < MAX_FRAMES_IN_FLIGHT; ++f)
+		if (frameSerials[f] != 0 && frameSerials[f] <= completed && vkGetFenceStatus(device, frames[f].fence) != VK_SUCCESS)
+			completed = frameSerials[f] - 1;
+	return completed;
 }
 
 void Mesh::setupVertexDescriptions() {
@@ -105,7 +298,7 @@ void Mesh::setupVertexDescriptions() {
 	vertices.bindingDescriptions[0] =
 		vkTools::initializers::vertexInputBindingDescription(
 			0,
-			(3+3)*sizeof(float),
+			sizeof(Vertex),
 			VK_VERTEX_INPUT_RATE_VERTEX);
 
 	vertices.attributeDescriptions.resize(2);
@@ -120,7 +313,7 @@ void Mesh::setupVertexDescriptions() {
 			0,
 			1,
 			VK_FORMAT_R32G32B32_SFLOAT,
-			3 * sizeof(float));
+			4 * sizeof(float));
 
 	vertices.inputState = vkTools::initializers::pipelineVertexInputStateCreateInfo();
 	vertices.inputState.vertexBindingDescriptionCount = vertices.bindingDescriptions.size();
@@ -130,16 +323,19 @@ void Mesh::setupVertexDescriptions() {
 }
 
 void Mesh::setupDescriptorPool() {
+	uint32_t imageCount = swapChain.imageCount;
 	std::vector<VkDescriptorPoolSize> poolSizes = {
-		vkTools::initializers::descriptorPoolSize(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, 1),
-		vkTools::initializers::descriptorPoolSize(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 2)
+		vkTools::initializers::descriptorPoolSize(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, 2 * imageCount),
+		vkTools::initializers::descriptorPoolSize(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 3 * imageCount + depthPyramid.mipLevels),
+		vkTools::initializers::descriptorPoolSize(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 2 * imageCount),
+		vkTools::initializers::descriptorPoolSize(VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, depthPyramid.mipLevels)
 	};
 
 	VkDescriptorPoolCreateInfo descriptorPoolInfo =
 		vkTools::initializers::descriptorPoolCreateInfo(
 			poolSizes.size(),
 			poolSizes.data(),
-			1);
+			2 * imageCount + depthPyramid.mipLevels);
 
 	vkTools::checkResult(vkCreateDescriptorPool(device, &descriptorPoolInfo, nullptr, &descriptorPool));
 }
@@ -173,17 +369,69 @@ void Mesh::setupDescriptorSetLayout() {
 			1);
 
 	vkTools::checkResult(vkCreatePipelineLayout(device, &pipelineLayoutCreateInfo, nullptr, &pipelineLayout));
-}
 
-void Mesh::setupDescriptorSet() {
-	VkDescriptorSetAllocateInfo allocInfo =
-		vkTools::initializers::descriptorSetAllocateInfo(
-			descriptorPool,
-			&descriptorSetLayout,
+	// Culling pass
+	std::vector<VkDescriptorSetLayoutBinding> cullLayoutBindings = {
+		vkTools::initializers::descriptorSetLayoutBinding(
+			VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER,
+			VK_SHADER_STAGE_COMPUTE_BIT,
+			0),
+		vkTools::initializers::descriptorSetLayoutBinding(
+			VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+			VK_SHADER_STAGE_COMPUTE_BIT,
+			1),
+		vkTools::initializers::descriptorSetLayoutBinding(
+			VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+			VK_SHADER_STAGE_COMPUTE_BIT,
+			2),
+		vkTools::initializers::descriptorSetLayoutBinding(
+			VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+			VK_SHADER_STAGE_COMPUTE_BIT,
+			3)
+	};
+
+	descriptorLayout =
+		vkTools::initializers::descriptorSetLayoutCreateInfo(
+			cullLayoutBindings.data(),
+			cullLayoutBindings.size());
+
+	vkTools::checkResult(vkCreateDescriptorSetLayout(device, &descriptorLayout, nullptr, &cullDescriptorSetLayout));
+
+	pipelineLayoutCreateInfo =
+		vkTools::initializers::pipelineLayoutCreateInfo(
+			&cullDescriptorSetLayout,
 			1);
 
-	vkTools::checkResult(vkAllocateDescriptorSets(device, &allocInfo, &descriptorSetPostCompute));
+	vkTools::checkResult(vkCreatePipelineLayout(device, &pipelineLayoutCreateInfo, nullptr, &cullPipelineLayout));
 
+	// Depth pyramid reduction
+	std::vector<VkDescriptorSetLayoutBinding> depthPyramidLayoutBindings = {
+		vkTools::initializers::descriptorSetLayoutBinding(
+			VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+			VK_SHADER_STAGE_COMPUTE_BIT,
+			0),
+		vkTools::initializers::descriptorSetLayoutBinding(
+			VK_DESCRIPTOR_TYPE_STORAGE_IMAGE,
+			VK_SHADER_STAGE_COMPUTE_BIT,
+			1)
+	};
+
+	descriptorLayout =
+		vkTools::initializers::descriptorSetLayoutCreateInfo(
+			depthPyramidLayoutBindings.data(),
+			depthPyramidLayoutBindings.size());
+
+	vkTools::checkResult(vkCreateDescriptorSetLayout(device, &descriptorLayout, nullptr, &depthPyramidDescriptorSetLayout));
+
+	pipelineLayoutCreateInfo =
+		vkTools::initializers::pipelineLayoutCreateInfo(
+			&depthPyramidDescriptorSetLayout,
+			1);
+
+	vkTools::checkResult(vkCreatePipelineLayout(device, &pipelineLayoutCreateInfo, nullptr, &depthPyramidPipelineLayout));
+}
+
+void Mesh::setupDescriptorSet() {
 	std::vector<VkDescriptorImageInfo> texDescriptors = {
 		vkTools::initializers::descriptorImageInfo(
 			textures.dirt.sampler,
@@ -195,24 +443,113 @@ void Mesh::setupDescriptorSet() {
 			VK_IMAGE_LAYOUT_GENERAL)
 	};
 
-	std::vector<VkWriteDescriptorSet> writeDescriptorSets = {
-		vkTools::initializers::writeDescriptorSet(
-			descriptorSetPostCompute,
-			VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER,
-			0,
-			&uniformData.mvp.descriptor),
-		vkTools::initializers::writeDescriptorSet(
-			descriptorSetPostCompute,
-			VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
-			1,
-			&texDescriptors[0]),
-		vkTools::initializers::writeDescriptorSet(
-			descriptorSetPostCompute,
-			VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
-			1,
-			&texDescriptors[1])
-	};
-	vkUpdateDescriptorSets(device, writeDescriptorSets.size(), writeDescriptorSets.data(), 0, NULL);
+	VkDescriptorBufferInfo drawsDescriptor = { meshes.terrain.draws.buf, 0, VK_WHOLE_SIZE };
+	VkDescriptorBufferInfo visibleDrawsDescriptor = { meshes.terrain.visibleDraws.buf, 0, VK_WHOLE_SIZE };
+	VkDescriptorImageInfo depthPyramidDescriptor =
+		vkTools::initializers::descriptorImageInfo(
+			depthPyramid.sampler,
+			depthPyramid.view,
+			VK_IMAGE_LAYOUT_GENERAL);
+
+	VkDescriptorSetAllocateInfo allocInfo;
+
+	// The sets only differ in the uniform buffers they read
+	descriptorSetsPostCompute.resize(swapChain.imageCount);
+	cullDescriptorSets.resize(swapChain.imageCount);
+	for (uint32_t i = 0; i < swapChain.imageCount; ++i) {
+		allocInfo =
+			vkTools::initializers::descriptorSetAllocateInfo(
+				descriptorPool,
+				&descriptorSetLayout,
+				1);
+
+		vkTools::checkResult(vkAllocateDescriptorSets(device, &allocInfo, &descriptorSetsPostCompute[i]));
+
+		VkDescriptorBufferInfo mvpDescriptor = uniforms->descriptor(uniformData[i].mvp, sizeof(uboMVP));
+		std::vector<VkWriteDescriptorSet> writeDescriptorSets = {
+			vkTools::initializers::writeDescriptorSet(
+				descriptorSetsPostCompute[i],
+				VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER,
+				0,
+				&mvpDescriptor),
+			vkTools::initializers::writeDescriptorSet(
+				descriptorSetsPostCompute[i],
+				VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+				1,
+				&texDescriptors[0]),
+			vkTools::initializers::writeDescriptorSet(
+				descriptorSetsPostCompute[i],
+				VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+				1,
+				&texDescriptors[1])
+		};
+		vkUpdateDescriptorSets(device, writeDescriptorSets.size(), writeDescriptorSets.data(), 0, NULL);
+
+		allocInfo =
+			vkTools::initializers::descriptorSetAllocateInfo(
+				descriptorPool,
+				&cullDescriptorSetLayout,
+				1);
+
+		vkTools::checkResult(vkAllocateDescriptorSets(device, &allocInfo, &cullDescriptorSets[i]));
+
+		VkDescriptorBufferInfo cullDescriptor = uniforms->descriptor(uniformData[i].cull, sizeof(uboCull));
+		std::vector<VkWriteDescriptorSet> cullWriteDescriptorSets = {
+			vkTools::initializers::writeDescriptorSet(
+				cullDescriptorSets[i],
+				VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER,
+				0,
+				&cullDescriptor),
+			vkTools::initializers::writeDescriptorSet(
+				cullDescriptorSets[i],
+				VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+				1,
+				&drawsDescriptor),
+			vkTools::initializers::writeDescriptorSet(
+				cullDescriptorSets[i],
+				VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+				2,
+				&visibleDrawsDescriptor),
+			vkTools::initializers::writeDescriptorSet(
+				cullDescriptorSets[i],
+				VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+				3,
+				&depthPyramidDescriptor)
+		};
+		vkUpdateDescriptorSets(device, cullWriteDescriptorSets.size(), cullWriteDescriptorSets.data(), 0, NULL);
+	}
+
+	// One set per pyramid level, reading the level above it
+	depthPyramidDescriptorSets.resize(depthPyramid.mipLevels);
+	for (uint32_t level = 0; level < depthPyramid.mipLevels; ++level) {
+		allocInfo =
+			vkTools::initializers::descriptorSetAllocateInfo(
+				descriptorPool,
+				&depthPyramidDescriptorSetLayout,
+				1);
+
+		vkTools::checkResult(vkAllocateDescriptorSets(device, &allocInfo, &depthPyramidDescriptorSets[level]));
+
+		VkDescriptorImageInfo sourceDescriptor = (level == 0) ?
+			vkTools::initializers::descriptorImageInfo(depthPyramid.sampler, depthView, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL) :
+			vkTools::initializers::descriptorImageInfo(depthPyramid.sampler, depthPyramid.mipViews[level - 1], VK_IMAGE_LAYOUT_GENERAL);
+		VkDescriptorImageInfo destinationDescriptor =
+			vkTools::initializers::descriptorImageInfo(VK_NULL_HANDLE, depthPyramid.mipViews[level], VK_IMAGE_LAYOUT_GENERAL);
+
+		std::vector<VkWriteDescriptorSet> levelDescriptorSets = {
+			vkTools::initializers::writeDescriptorSet(
+				depthPyramidDescriptorSets[level],
+				VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+				0,
+				&sourceDescriptor),
+			vkTools::initializers::writeDescriptorSet(
+				depthPyramidDescriptorSets[level],
+				VK_DESCRIPTOR_TYPE_STORAGE_IMAGE,
+				1,
+				&destinationDescriptor)
+		};
+		vkUpdateDescriptorSets(device, levelDescriptorSets.size(), levelDescriptorSets.data(), 0, NULL);
+	}
 }
 
 void Mesh::preparePipelines() {
@@ -287,40 +624,176 @@ void Mesh::preparePipelines() {
 	pipelineCreateInfo.renderPass = renderPass;
 
 	vkTools::checkResult(vkCreateGraphicsPipelines(device, pipelineCache, 1, &pipelineCreateInfo, nullptr, &pipelines.render));
+
+	VkComputePipelineCreateInfo cullPipelineCreateInfo =
+		vkTools::initializers::computePipelineCreateInfo(
+			cullPipelineLayout,
+			0);
+	cullPipelineCreateInfo.stage = loadShader("./../data/shaders/Cull.comp.spv", VK_SHADER_STAGE_COMPUTE_BIT);
+	vkTools::checkResult(vkCreateComputePipelines(device, pipelineCache, 1, &cullPipelineCreateInfo, nullptr, &pipelines.cull));
+
+	VkComputePipelineCreateInfo depthPyramidPipelineCreateInfo =
+		vkTools::initializers::computePipelineCreateInfo(
+			depthPyramidPipelineLayout,
+			0);
+	depthPyramidPipelineCreateInfo.stage = loadShader("./../data/shaders/DepthPyramid.comp.spv", VK_SHADER_STAGE_COMPUTE_BIT);
+	vkTools::checkResult(vkCreateComputePipelines(device, pipelineCache, 1, &depthPyramidPipelineCreateInfo, nullptr, &pipelines.depthPyramid));
+}
+
+void Mesh::prepareDepthPyramid() {
+	// Level 0 is half the resolution of the depth attachment
+	depthPyramid.width = std::max(width / 2, 1u);
+	depthPyramid.height = std::max(height / 2, 1u);
+	depthPyramid.mipLevels = 1;
+	while ((std::max(depthPyramid.width, depthPyramid.height) >> depthPyramid.mipLevels) > 0)
+		++depthPyramid.mipLevels;
+
+	VkImageCreateInfo imageCreateInfo = vkTools::initializers::imageCreateInfo();
+	imageCreateInfo.imageType = VK_IMAGE_TYPE_2D;
+	imageCreateInfo.format = VK_FORMAT_R32_SFLOAT;
+	imageCreateInfo.extent = { depthPyramid.width, depthPyramid.height, 1 };
+	imageCreateInfo.mipLevels = depthPyramid.mipLevels;
+	imageCreateInfo.arrayLayers = 1;
+	imageCreateInfo.samples = VK_SAMPLE_COUNT_1_BIT;
+	imageCreateInfo.tiling = VK_IMAGE_TILING_OPTIMAL;
+	imageCreateInfo.usage = VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT;
+	imageCreateInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+	vkTools::checkResult(vkCreateImage(device, &imageCreateInfo, nullptr, &depthPyramid.image));
+
+	depthPyramid.mem = allocator->allocateImage(depthPyramid.image, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+
+	// The pyramid stays in the general layout, it is written and sampled by compute only.
+	// Until the first frame is drawn it is cleared to the far plane so nothing gets culled
+	VkImageSubresourceRange subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, 0, depthPyramid.mipLevels, 0, 1 };
+	vkTools::setImageLayout(
+		setupCmdBuffer,
+		depthPyramid.image,
+		VK_IMAGE_ASPECT_COLOR_BIT,
+		VK_IMAGE_LAYOUT_UNDEFINED,
+		VK_IMAGE_LAYOUT_GENERAL,
+		subresourceRange);
+	VkClearColorValue farPlane = { 1.0f, 1.0f, 1.0f, 1.0f };
+	vkCmdClearColorImage(setupCmdBuffer, depthPyramid.image, VK_IMAGE_LAYOUT_GENERAL, &farPlane, 1, &subresourceRange);
+
+	VkImageViewCreateInfo viewCreateInfo = vkTools::initializers::imageViewCreateInfo();
+	viewCreateInfo.viewType = VK_IMAGE_VIEW_TYPE_2D;
+	viewCreateInfo.format = VK_FORMAT_R32_SFLOAT;
+	viewCreateInfo.components = { VK_COMPONENT_SWIZZLE_R, VK_COMPONENT_SWIZZLE_G, VK_COMPONENT_SWIZZLE_B, VK_COMPONENT_SWIZZLE_A };
+	viewCreateInfo.subresourceRange = subresourceRange;
+	viewCreateInfo.image = depthPyramid.image;
+	vkTools::checkResult(vkCreateImageView(device, &viewCreateInfo, nullptr, &depthPyramid.view));
+
+	depthPyramid.mipViews.resize(depthPyramid.mipLevels);
+	for (uint32_t level = 0; level < depthPyramid.mipLevels; ++level) {
+		viewCreateInfo.subresourceRange.baseMipLevel = level;
+		viewCreateInfo.subresourceRange.levelCount = 1;
+		vkTools::checkResult(vkCreateImageView(device, &viewCreateInfo, nullptr, &depthPyramid.mipViews[level]));
+	}
+
+	// Sampled views of depth/stencil images may only contain a single aspect
+	viewCreateInfo.format = depthFormat;
+	viewCreateInfo.subresourceRange = { VK_IMAGE_ASPECT_DEPTH_BIT, 0, 1, 0, 1 };
+	viewCreateInfo.image = depthStencil.image;
+	vkTools::checkResult(vkCreateImageView(device, &viewCreateInfo, nullptr, &depthView));
+
+	VkSamplerCreateInfo samplerCreateInfo = vkTools::initializers::samplerCreateInfo();
+	samplerCreateInfo.magFilter = VK_FILTER_NEAREST;
+	samplerCreateInfo.minFilter = VK_FILTER_NEAREST;
+	samplerCreateInfo.mipmapMode = VK_SAMPLER_MIPMAP_MODE_NEAREST;
+	samplerCreateInfo.addressModeU = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+	samplerCreateInfo.addressModeV = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+	samplerCreateInfo.addressModeW = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+	samplerCreateInfo.minLod = 0.0f;
+	samplerCreateInfo.maxLod = (float)depthPyramid.mipLevels;
+	samplerCreateInfo.borderColor = VK_BORDER_COLOR_FLOAT_OPAQUE_WHITE;
+	vkTools::checkResult(vkCreateSampler(device, &samplerCreateInfo, nullptr, &depthPyramid.sampler));
 }
 
 void Mesh::prepareUniformBuffers() {
+	assert(meshes.terrain.drawCount > 0);
+	uboCull.drawCount = meshes.terrain.drawCount;
+	uboCull.chunkSize = Chunk::CHUNK_SIZE;
+	uboCull.pyramidSize = glm::vec2(depthPyramid.width, depthPyramid.height);
+	uboCull.pyramidLevels = depthPyramid.mipLevels;
+	lastViewProjection = cam->projection * cam->view;
+
+	uniforms = new PerImageUniforms(device, allocator, deviceProperties.limits, { sizeof(uboMVP), sizeof(uboCull) }, swapChain.imageCount);
+	uniformData.resize(swapChain.imageCount);
+	for (uint32_t i = 0; i < swapChain.imageCount; ++i) {
+		uniformData[i].mvp = uniforms->slice(i, 0);
+		uniformData[i].cull = uniforms->slice(i, 1);
+	}
+
+	// Only ever touched on the graphics queue. The generator hands in finished draws through updateDraw,
+	// so a batch that is still being generated is never culled or drawn
+	std::vector<uint8_t> emptyDraws(meshes.terrain.drawCount * meshes.terrain.drawStride, 0);
 	createBuffer(
-		VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
-		sizeof(uboMVP),
-		&uboMVP,
-		&uniformData.mvp.buffer,
-		&uniformData.mvp.memory,
-		&uniformData.mvp.descriptor);
+		VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+		emptyDraws.size(),
+		emptyDraws.data(),
+		&meshes.terrain.draws.buf,
+		&meshes.terrain.draws.mem);
 
-	updateUniformBuffers();
+	createBuffer(
+		VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT,
+		meshes.terrain.drawCount * sizeof(VkDrawIndexedIndirectCommand),
+		nullptr,
+		&meshes.terrain.visibleDraws.buf,
+		&meshes.terrain.visibleDraws.mem);
+
+	VkCommandBufferAllocateInfo cmdBufAllocateInfo =
+		vkTools::initializers::commandBufferAllocateInfo(
+			cmdPool,
+			VK_COMMAND_BUFFER_LEVEL_PRIMARY,
+			MAX_FRAMES_IN_FLIGHT);
+	vkTools::checkResult(vkAllocateCommandBuffers(device, &cmdBufAllocateInfo, drawUpdateCmdBuffers.data()));
 }
 
+// Writes the uniform buffers of the swapchain image about to be drawn
 void Mesh::updateUniformBuffers() {
 	uboMVP.projection = cam->projection;
 	uboMVP.view = cam->view;
 	uboMVP.model = glm::mat4();
 
-	uint8_t *pData;
-	vkTools::checkResult(vkMapMemory(device, uniformData.mvp.memory, 0, sizeof(uboMVP), 0, (void **)&pData));
-	memcpy(pData, &uboMVP, sizeof(uboMVP));
-	vkUnmapMemory(device, uniformData.mvp.memory);
+	memcpy(uniformData[currentBuffer].mvp.mapped, &uboMVP, sizeof(uboMVP));
+
+	updateFrustumPlanes();
+}
+
+// Extracts the planes of the view frustum from the combined view projection matrix,
+// all planes point inwards
+void Mesh::updateFrustumPlanes() {
+	// The depth pyramid was built with the matrix of the previous update
+	glm::mat4 viewProjection = uboMVP.projection * uboMVP.view * uboMVP.model;
+	uboCull.occlusionViewProjection = lastViewProjection;
+	lastViewProjection = viewProjection;
+	glm::vec4 row[4];
+	for (int r = 0; r < 4; ++r)
+		row[r] = glm::vec4(viewProjection[0][r], viewProjection[1][r], viewProjection[2][r], viewProjection[3][r]);
+
+	uboCull.frustumPlanes[0] = row[3] + row[0]; // left
+	uboCull.frustumPlanes[1] = row[3] - row[0]; // right
+	uboCull.frustumPlanes[2] = row[3] + row[1]; // bottom
+	uboCull.frustumPlanes[3] = row[3] - row[1]; // top
+	uboCull.frustumPlanes[4] = row[3] + row[2]; // near
+	uboCull.frustumPlanes[5] = row[3] - row[2]; // far
+	for (auto &plane : uboCull.frustumPlanes)
+		plane /= glm::length(glm::vec3(plane));
+
+	memcpy(uniformData[currentBuffer].cull.mapped, &uboCull, sizeof(uboCull));
 }
 
 void Mesh::prepare() {
 	VulkanBase::prepare();
 	loadTextures();
 	setupVertexDescriptions();
+	prepareDepthPyramid();
 	prepareUniformBuffers();
 	setupDescriptorSetLayout();
 	preparePipelines();
 	setupDescriptorPool();
 	setupDescriptorSet();
+	flushSetupCommandBuffer();
 	buildCommandBuffers();
 	prepared = true;
 }
@@ -329,13 +802,7 @@ void Mesh::render() {
 	if (!prepared)
 		return;
 	updateCamera();
-	vkDeviceWaitIdle(device);
 	draw();
-	vkDeviceWaitIdle(device);
-}
-
-void Mesh::viewChanged() {
-	updateUniformBuffers();
 }
 
 // Updates the camera once per frame
@@ -361,7 +828,6 @@ void Mesh::updateCamera() {
 	if(true)
 		cam->rotate(Axis::U, speed*frameTimer*mouseDelta[1]);
 	SetCursorPos(centerPos.x, centerPos.y);
-	viewChanged();
 }
 
 void Mesh::handleMessages(HWND hWnd, UINT uMsg, WPARAM wParam, LPARAM lParam) {
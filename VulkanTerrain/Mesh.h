@@ -1,7 +1,10 @@
 #pragma once
 
+#include <map>
+
 #include "VulkanBase.h"
 #include "Camera.hpp"
+#include "Vertex.hpp"
 
 #define KEYBOARD_C 0x43
 #define KEYBOARD_P 0x50
@@ -10,27 +13,29 @@
 #define KEYBOARD_S 0x53
 #define KEYBOARD_D 0x44
 
-struct Vertex {
-	float pos[3];
-	float norm[3];
-};
-
 class Mesh : public VulkanBase {
 public:
-	Mesh(bool enableValidation);
+	// Renders with the device of the terrain generator, so it can draw straight from the generator's buffers
+	Mesh(VulkanBase *generator);
 	~Mesh();
 private:
 	struct MeshBufferInfo
 	{
 		VkBuffer buf = VK_NULL_HANDLE;
-		VkDeviceMemory mem = VK_NULL_HANDLE;
+		vkTools::Allocation mem;
 	};
 
 	struct MeshBuffer
 	{
 		MeshBufferInfo vertices;
 		MeshBufferInfo indices;
-		uint32_t indexCount;
+		// Draw table of the arena slots, drawCount entries drawStride bytes apart, see updateDraw.
+		// Each entry starts with a VkDrawIndexedIndirectCommand followed by the chunk bounds
+		MeshBufferInfo draws;
+		uint32_t drawCount = 0;
+		uint32_t drawStride = 0;
+		// Tightly packed copy of the draw table with culled chunks zeroed, this is what gets drawn
+		MeshBufferInfo visibleDraws;
 	};
 
 public:
@@ -56,31 +61,85 @@ private:
 		glm::mat4 projection;
 	} uboMVP;
 
+	// Matches the UBO in Cull.comp
+	struct {
+		// View projection the depth pyramid was rendered with
+		glm::mat4 occlusionViewProjection;
+		glm::vec4 frustumPlanes[6];
+		glm::vec2 pyramidSize;
+		uint32_t drawCount;
+		uint32_t chunkSize;
+		uint32_t pyramidLevels;
+	} uboCull;
+
+	// Hierarchical depth of the last frame, every texel holds the farthest depth of the area it covers
+	struct {
+		VkImage image;
+		vkTools::Allocation mem;
+		// All levels, sampled by the culling pass
+		VkImageView view;
+		// One view per level, written by the reduction pass
+		std::vector<VkImageView> mipViews;
+		VkSampler sampler;
+		uint32_t width;
+		uint32_t height;
+		uint32_t mipLevels;
+	} depthPyramid;
+
+	// Depth aspect of the depth attachment, source of the first pyramid level
+	VkImageView depthView;
+	glm::mat4 lastViewProjection;
+
 	struct {
 		vkTools::VulkanTexture dirt;
 		vkTools::VulkanTexture grass;
 	} textures;
 
-	struct {
-		vkTools::UniformData mvp;
-	} uniformData;
+	// Uniform slices per swapchain image, the command buffers of images still in flight keep reading theirs
+	struct UniformSlices {
+		PerImageUniforms::Slice mvp;
+		PerImageUniforms::Slice cull;
+	};
+	std::vector<UniformSlices> uniformData;
 
 	struct {
 		VkPipeline render;
+		VkPipeline cull;
+		VkPipeline depthPyramid;
 	} pipelines;
 
 	VkPipelineLayout pipelineLayout;
-	VkDescriptorSet descriptorSetPostCompute;
+	std::vector<VkDescriptorSet> descriptorSetsPostCompute;
 	VkDescriptorSetLayout descriptorSetLayout;
 
+	VkPipelineLayout cullPipelineLayout;
+	std::vector<VkDescriptorSet> cullDescriptorSets;
+	VkDescriptorSetLayout cullDescriptorSetLayout;
+
+	VkPipelineLayout depthPyramidPipelineLayout;
+	std::vector<VkDescriptorSet> depthPyramidDescriptorSets;
+	VkDescriptorSetLayout depthPyramidDescriptorSetLayout;
+
 	float moveSpeed;
 	float sprintSpeed;
 
+	// Regions of the draw command buffers measured by the profiler
+	enum ProfilerRegion {
+		PROFILE_CULL,
+		PROFILE_RENDER,
+		PROFILE_DEPTH_PYRAMID
+	};
+
+	// Draw table entries written ahead of the next frame, keyed by slot so that only the last write counts
+	std::map<uint32_t, std::vector<uint8_t>> pendingDraws;
+	std::array<VkCommandBuffer, MAX_FRAMES_IN_FLIGHT> drawUpdateCmdBuffers;
+	// Value of submittedFrames for the frame last submitted with each of frames
+	std::array<uint64_t, MAX_FRAMES_IN_FLIGHT> frameSerials = {};
+
 	bool keyboardState[256] = { false };
 	float mouseDelta[2] = { 0.0f };
 
 	void loadTextures();
-	void buildCommandBuffers();
 	void draw();
 	void setupVertexDescriptions();
 	void setupDescriptorPool();
@@ -88,12 +147,24 @@ private:
 	void setupDescriptorSet();
 	void preparePipelines();
 	void prepareUniformBuffers();
+	void prepareDepthPyramid();
+	void buildDepthPyramid(VkCommandBuffer cmdBuffer);
+	void recordDrawUpdates(VkCommandBuffer cmdBuffer);
 	void updateUniformBuffers();
-	void prepare();
+	void updateFrustumPlanes();
 	virtual void render();
-	void viewChanged();
 	void updateCamera();
 public:
+	// Needs meshes.terrain to point at the generator's arena
+	void prepare();
+	// Replaces the draw of an arena slot, the frames submitted from then on draw the new one.
+	// The arena contents it points at must have finished generating before the call
+	void updateDraw(uint32_t slot, const void *drawCommand);
+	// Frames are numbered from 1 as they are submitted
+	uint64_t submittedFrames = 0;
+	// Every frame up to the returned one has finished executing
+	uint64_t completedFrames();
+	void buildCommandBuffers();
 	void handleMessages(
 		HWND hWnd,
 		UINT uMsg,
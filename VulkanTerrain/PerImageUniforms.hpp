@@ -0,0 +1,63 @@
+#pragma once
+
+#include <algorithm>
+#include <initializer_list>
+#include <vector>
+
+#include "vulkan.h"
+#include "base/vulkantools.h"
+#include "base/vulkanallocator.hpp"
+
+// Persistently mapped uniform buffer with one region per swapchain image. A region holds one slice of each
+// of the given sizes, aligned to minUniformBufferOffsetAlignment. Slices never move, so descriptors are written
+// once. The owner only writes the region of an image after that image's last frame has finished, see Mesh::draw.
+// Updating uniforms is a plain copy into a slice
+class PerImageUniforms {
+public:
+	struct Slice {
+		// Offset into the buffer, used in the descriptor
+		uint32_t offset;
+		void *mapped;
+	};
+
+	PerImageUniforms(VkDevice device, vkTools::VulkanAllocator *allocator, const VkPhysicalDeviceLimits &limits, std::initializer_list<VkDeviceSize> sliceSizes, uint32_t imageCount)
+		: device(device), allocator(allocator), imageCount(imageCount) {
+		VkDeviceSize alignment = std::max<VkDeviceSize>(limits.minUniformBufferOffsetAlignment, 1);
+		for (VkDeviceSize size : sliceSizes) {
+			sliceOffsets.push_back(regionSize);
+			regionSize += (size + alignment - 1) / alignment * alignment;
+		}
+
+		VkBufferCreateInfo bufferInfo = vkTools::initializers::bufferCreateInfo(VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, regionSize * imageCount);
+		vkTools::checkResult(vkCreateBuffer(device, &bufferInfo, nullptr, &buffer));
+		memory = allocator->allocateBuffer(buffer, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+	}
+
+	~PerImageUniforms() {
+		vkDestroyBuffer(device, buffer, nullptr);
+		allocator->free(memory);
+	}
+
+	PerImageUniforms(const PerImageUniforms &) = delete;
+	PerImageUniforms &operator=(const PerImageUniforms &) = delete;
+
+	// index is the position of the slice's size in the constructor's sliceSizes
+	Slice slice(uint32_t image, uint32_t index) const {
+		assert(image < imageCount && index < sliceOffsets.size());
+		VkDeviceSize offset = image * regionSize + sliceOffsets[index];
+		return { (uint32_t)offset, (uint8_t*)memory.mapped + offset };
+	}
+
+	VkDescriptorBufferInfo descriptor(const Slice &slice, VkDeviceSize range) const {
+		return { buffer, slice.offset, range };
+	}
+
+private:
+	VkDevice device;
+	vkTools::VulkanAllocator *allocator;
+	VkBuffer buffer = VK_NULL_HANDLE;
+	vkTools::Allocation memory;
+	VkDeviceSize regionSize = 0;
+	std::vector<VkDeviceSize> sliceOffsets;
+	uint32_t imageCount;
+};
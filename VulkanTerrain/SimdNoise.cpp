@@ -0,0 +1,286 @@
+#include "SimdNoise.h"
+
+#include <cmath>
+
+// Same as in Density.hpp, so that every lane computes exactly what the scalar reference computes
+#if defined(_MSC_VER)
+#pragma fp_contract(off)
+#elif defined(__clang__)
+#pragma STDC FP_CONTRACT OFF
+#endif
+
+#if defined(__AVX512F__) || defined(__AVX2__)
+#include <immintrin.h>
+#endif
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define NOISE_SSE2
+#endif
+#if defined(__SSE4_1__) || defined(__AVX__)
+#include <smmintrin.h>
+#define NOISE_SSE4_1
+#endif
+
+// Each lane type wraps one register of floats. The noise below is written once against their
+// common interface and instantiated for the widest one available
+
+static const float laneIndices[16] = { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 };
+
+struct Lane1 {
+	static const size_t width = 1;
+	float v;
+
+	Lane1(float f) : v(f) {}
+	static Lane1 load(const float *p) { return Lane1(*p); }
+	void store(float *p) const { *p = v; }
+
+	friend Lane1 operator+(Lane1 a, Lane1 b) { return Lane1(a.v + b.v); }
+	friend Lane1 operator-(Lane1 a, Lane1 b) { return Lane1(a.v - b.v); }
+	friend Lane1 operator*(Lane1 a, Lane1 b) { return Lane1(a.v * b.v); }
+	friend Lane1 floor(Lane1 a) { return Lane1(std::floor(a.v)); }
+	friend Lane1 min(Lane1 a, Lane1 b) { return Lane1(b.v < a.v ? b.v : a.v); }
+	friend Lane1 max(Lane1 a, Lane1 b) { return Lane1(a.v < b.v ? b.v : a.v); }
+	friend Lane1 abs(Lane1 a) { return Lane1(std::fabs(a.v)); }
+	// GLSL step
+	friend Lane1 step(Lane1 edge, Lane1 x) { return Lane1(x.v < edge.v ? 0.0f : 1.0f); }
+};
+
+#if defined(NOISE_SSE2)
+struct Lane4 {
+	static const size_t width = 4;
+	__m128 v;
+
+	Lane4(__m128 m) : v(m) {}
+	Lane4(float f) : v(_mm_set1_ps(f)) {}
+	static Lane4 load(const float *p) { return Lane4(_mm_loadu_ps(p)); }
+	void store(float *p) const { _mm_storeu_ps(p, v); }
+
+	friend Lane4 operator+(Lane4 a, Lane4 b) { return Lane4(_mm_add_ps(a.v, b.v)); }
+	friend Lane4 operator-(Lane4 a, Lane4 b) { return Lane4(_mm_sub_ps(a.v, b.v)); }
+	friend Lane4 operator*(Lane4 a, Lane4 b) { return Lane4(_mm_mul_ps(a.v, b.v)); }
+	friend Lane4 floor(Lane4 a) {
+#if defined(NOISE_SSE4_1)
+		return Lane4(_mm_floor_ps(a.v));
+#else
+		// Truncate, then step down where that rounded up. Noise inputs stay well within the int32 range
+		__m128 truncated = _mm_cvtepi32_ps(_mm_cvttps_epi32(a.v));
+		return Lane4(_mm_sub_ps(truncated, _mm_and_ps(_mm_cmpgt_ps(truncated, a.v), _mm_set1_ps(1.0f))));
+#endif
+	}
+	friend Lane4 min(Lane4 a, Lane4 b) { return Lane4(_mm_min_ps(a.v, b.v)); }
+	friend Lane4 max(Lane4 a, Lane4 b) { return Lane4(_mm_max_ps(a.v, b.v)); }
+	friend Lane4 abs(Lane4 a) { return Lane4(_mm_andnot_ps(_mm_set1_ps(-0.0f), a.v)); }
+	friend Lane4 step(Lane4 edge, Lane4 x) { return Lane4(_mm_and_ps(_mm_cmpge_ps(x.v, edge.v), _mm_set1_ps(1.0f))); }
+};
+#endif
+
+#if defined(__AVX2__)
+struct Lane8 {
+	static const size_t width = 8;
+	__m256 v;
+
+	Lane8(__m256 m) : v(m) {}
+	Lane8(float f) : v(_mm256_set1_ps(f)) {}
+	static Lane8 load(const float *p) { return Lane8(_mm256_loadu_ps(p)); }
+	void store(float *p) const { _mm256_storeu_ps(p, v); }
+
+	friend Lane8 operator+(Lane8 a, Lane8 b) { return Lane8(_mm256_add_ps(a.v, b.v)); }
+	friend Lane8 operator-(Lane8 a, Lane8 b) { return Lane8(_mm256_sub_ps(a.v, b.v)); }
+	friend Lane8 operator*(Lane8 a, Lane8 b) { return Lane8(_mm256_mul_ps(a.v, b.v)); }
+	friend Lane8 floor(Lane8 a) { return Lane8(_mm256_floor_ps(a.v)); }
+	friend Lane8 min(Lane8 a, Lane8 b) { return Lane8(_mm256_min_ps(a.v, b.v)); }
+	friend Lane8 max(Lane8 a, Lane8 b) { return Lane8(_mm256_max_ps(a.v, b.v)); }
+	friend Lane8 abs(Lane8 a) { return Lane8(_mm256_andnot_ps(_mm256_set1_ps(-0.0f), a.v)); }
+	friend Lane8 step(Lane8 edge, Lane8 x) { return Lane8(_mm256_and_ps(_mm256_cmp_ps(x.v, edge.v, _CMP_GE_OQ), _mm256_set1_ps(1.0f))); }
+};
+#endif
+
+#if defined(__AVX512F__)
+struct Lane16 {
+	static const size_t width = 16;
+	__m512 v;
+
+	Lane16(__m512 m) : v(m) {}
+	Lane16(float f) : v(_mm512_set1_ps(f)) {}
+	static Lane16 load(const float *p) { return Lane16(_mm512_loadu_ps(p)); }
+	void store(float *p) const { _mm512_storeu_ps(p, v); }
+
+	friend Lane16 operator+(Lane16 a, Lane16 b) { return Lane16(_mm512_add_ps(a.v, b.v)); }
+	friend Lane16 operator-(Lane16 a, Lane16 b) { return Lane16(_mm512_sub_ps(a.v, b.v)); }
+	friend Lane16 operator*(Lane16 a, Lane16 b) { return Lane16(_mm512_mul_ps(a.v, b.v)); }
+	friend Lane16 floor(Lane16 a) { return Lane16(_mm512_roundscale_ps(a.v, _MM_FROUND_TO_NEG_INF | _MM_FROUND_NO_EXC)); }
+	friend Lane16 min(Lane16 a, Lane16 b) { return Lane16(_mm512_min_ps(a.v, b.v)); }
+	friend Lane16 max(Lane16 a, Lane16 b) { return Lane16(_mm512_max_ps(a.v, b.v)); }
+	friend Lane16 abs(Lane16 a) { return Lane16(_mm512_abs_ps(a.v)); }
+	friend Lane16 step(Lane16 edge, Lane16 x) {
+		return Lane16(_mm512_mask_blend_ps(_mm512_cmp_ps_mask(x.v, edge.v, _CMP_LT_OQ), _mm512_set1_ps(1.0f), _mm512_setzero_ps()));
+	}
+};
+#endif
+
+#if defined(__AVX512F__)
+typedef Lane16 WideLane;
+#elif defined(__AVX2__)
+typedef Lane8 WideLane;
+#elif defined(NOISE_SSE2)
+typedef Lane4 WideLane;
+#else
+typedef Lane1 WideLane;
+#endif
+
+template<typename L>
+static L mod289(L x) {
+	return x - floor(x * (1.0f / 289.0f)) * 289.0f;
+}
+
+template<typename L>
+static L permute(L x) {
+	return mod289((x * 34.0f + 1.0f) * x);
+}
+
+// Contribution of one simplex corner given its permutation value and offset
+template<typename L>
+static L corner(L p, L x, L y, L z) {
+	// ns = n_ * D.wyz - D.xzx
+	const float n_ = 0.142857142857f;
+	const float nsx = n_ * 2.0f;
+	const float nsy = n_ * 0.5f - 1.0f;
+	const float nsz = n_;
+
+	L j = p - 49.0f * floor(p * nsz * nsz);
+
+	L x_ = floor(j * nsz);
+	L y_ = floor(j - 7.0f * x_);
+
+	L gx = x_ * nsx + nsy;
+	L gy = y_ * nsx + nsy;
+	L h = 1.0f - abs(gx) - abs(gy);
+
+	L sh = 0.0f - step(h, 0.0f);
+	gx = gx + (floor(gx) * 2.0f + 1.0f) * sh;
+	gy = gy + (floor(gy) * 2.0f + 1.0f) * sh;
+
+	// Normalise gradient
+	L norm = 1.79284291400159f - 0.85373472095314f * (gx * gx + gy * gy + h * h);
+	gx = gx * norm;
+	gy = gy * norm;
+	h = h * norm;
+
+	L m = max(0.6f - (x * x + y * y + z * z), 0.0f);
+	m = m * m;
+	return m * m * (gx * x + gy * y + h * z);
+}
+
+// Same operations as Density::snoise, one point per lane
+template<typename L>
+static L snoise(L vx, L vy, L vz) {
+	const float Cx = 1.0f / 6.0f;
+	const float Cy = 1.0f / 3.0f;
+
+	// First corner
+	L s = vx * Cy + vy * Cy + vz * Cy;
+	L ix = floor(vx + s);
+	L iy = floor(vy + s);
+	L iz = floor(vz + s);
+	L t = ix * Cx + iy * Cx + iz * Cx;
+	L x0x = vx - ix + t;
+	L x0y = vy - iy + t;
+	L x0z = vz - iz + t;
+
+	// Other corners
+	L gx = step(x0y, x0x);
+	L gy = step(x0z, x0y);
+	L gz = step(x0x, x0z);
+	L lx = 1.0f - gx;
+	L ly = 1.0f - gy;
+	L lz = 1.0f - gz;
+	L i1x = min(gx, lz);
+	L i1y = min(gy, lx);
+	L i1z = min(gz, ly);
+	L i2x = max(gx, lz);
+	L i2y = max(gy, lx);
+	L i2z = max(gz, ly);
+
+	// Permutations
+	ix = mod289(ix);
+	iy = mod289(iy);
+	iz = mod289(iz);
+	L p0 = permute(permute(permute(iz + 0.0f) + iy + 0.0f) + ix + 0.0f);
+	L p1 = permute(permute(permute(iz + i1z) + iy + i1y) + ix + i1x);
+	L p2 = permute(permute(permute(iz + i2z) + iy + i2y) + ix + i2x);
+	L p3 = permute(permute(permute(iz + 1.0f) + iy + 1.0f) + ix + 1.0f);
+
+	L n0 = corner(p0, x0x, x0y, x0z);
+	L n1 = corner(p1, x0x - i1x + Cx, x0y - i1y + Cx, x0z - i1z + Cx);
+	L n2 = corner(p2, x0x - i2x + Cy, x0y - i2y + Cy, x0z - i2z + Cy);
+	L n3 = corner(p3, x0x - 0.5f, x0y - 0.5f, x0z - 0.5f);
+	// Summed pairwise like glm's vec4 dot product
+	return 42.0f * ((n0 + n1) + (n2 + n3));
+}
+
+// Same operations as Density::terrain, one point per lane
+template<typename L>
+static L terrain(L x, L y, L z) {
+	L density = 0.0f - y;
+
+	const float angle = 0.9f;
+	const float c = std::cos(angle);
+	const float s = std::sin(angle);
+
+	// Flat zones
+	density = density + min(max(35.0f - y, 0.0f), 1.0f) * 10.0f;
+	density = density + min(max(30.0f - y, 0.0f), 1.0f) * 20.0f;
+	density = density + min(max(20.0f - y, 0.0f), 1.0f) * 10.0f;
+	density = density + min(max(10.0f - y, 0.0f), 1.0f) * 5.0f;
+	density = density + min(max(3.0f - y, 0.0f), 1.0f) * 10.0f;
+
+	// Domain warp
+	const float warpFrequencies[3] = { 0.0035f, 0.0015f, 0.0007f };
+	const float warpAmplitudes[3] = { 60.0f, 120.0f, 240.0f };
+	for (int i = 0; i < 3; ++i) {
+		L warp = warpAmplitudes[i] * snoise(x * warpFrequencies[i], y * warpFrequencies[i], z * warpFrequencies[i]);
+		x = x + warp;
+		y = y + warp;
+		z = z + warp;
+	}
+
+	// The rotation matrix zeroes z
+	L rx = c * x + s * y;
+	L ry = (0.0f - s) * x + c * y;
+	density = density + 0.25f * snoise(rx * 0.401f, ry * 0.401f, L(0.0f));
+	density = density + 0.5f * snoise(rx * 0.193f, ry * 0.193f, L(0.0f));
+
+	const float frequencies[7] = { 0.101f, 0.049f, 0.022f, 0.01f, 0.0051f, 0.0023f, 0.0009f };
+	const float amplitudes[7] = { 1.0f, 2.0f, 4.0f, 8.0f, 16.0f, 24.0f, 48.0f };
+	for (int i = 0; i < 7; ++i)
+		density = density + amplitudes[i] * snoise(x * frequencies[i], y * frequencies[i], z * frequencies[i]);
+
+	return density;
+}
+
+size_t Density::laneCount() {
+	return WideLane::width;
+}
+
+void Density::snoiseBatch(const float *x, const float *y, const float *z, float *out, size_t count) {
+	size_t i = 0;
+	for (; i + WideLane::width <= count; i += WideLane::width)
+		snoise(WideLane::load(x + i), WideLane::load(y + i), WideLane::load(z + i)).store(out + i);
+	for (; i < count; ++i)
+		snoise(Lane1(x[i]), Lane1(y[i]), Lane1(z[i])).store(out + i);
+}
+
+void Density::terrainBlock(glm::vec3 origin, float spacing, glm::ivec3 size, float *densities) {
+	WideLane ramp = WideLane::load(laneIndices);
+	for (int z = 0; z < size.z; ++z)
+		for (int y = 0; y < size.y; ++y) {
+			float *row = densities + ((size_t)z * size.y + y) * size.x;
+			float wy = origin.y + y * spacing;
+			float wz = origin.z + z * spacing;
+			int x = 0;
+			for (; x + (int)WideLane::width <= size.x; x += WideLane::width)
+				terrain<WideLane>(origin.x + ((float)x + ramp) * spacing, wy, wz).store(row + x);
+			for (; x < size.x; ++x)
+				terrain<Lane1>(origin.x + x * spacing, wy, wz).store(row + x);
+		}
+}
@@ -0,0 +1,21 @@
+#pragma once
+
+#include <cstddef>
+
+#include <glm/glm.hpp>
+
+// Batched versions of the functions in Density.hpp. Points are evaluated in groups of laneCount() with the
+// widest instruction set the translation unit is compiled for (AVX-512F, AVX2 or SSE2), remaining points
+// with the scalar reference. Results are bit-identical to Density.hpp as long as neither is compiled with
+// contraction into fused multiply-adds, see Density.hpp. They match Density.comp up to GPU float rounding
+namespace Density {
+	// Number of points evaluated at once
+	size_t laneCount();
+
+	// out[i] = snoise(vec3(x[i], y[i], z[i]))
+	void snoiseBatch(const float *x, const float *y, const float *z, float *out, size_t count);
+
+	// Fills densities with terrain(origin + vec3(x, y, z) * spacing) for every point of a size.x * size.y * size.z
+	// block, x being the innermost axis
+	void terrainBlock(glm::vec3 origin, float spacing, glm::ivec3 size, float *densities);
+}
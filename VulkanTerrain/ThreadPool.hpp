@@ -0,0 +1,75 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+
+// Fixed set of worker threads consuming a shared task queue
+class ThreadPool {
+public:
+	ThreadPool(uint32_t threadCount) {
+		if (threadCount == 0)
+			threadCount = 1;
+		for (uint32_t i = 0; i < threadCount; ++i)
+			workers.emplace_back([this] { work(); });
+	}
+
+	// Finishes the queued tasks before the workers are joined
+	~ThreadPool() {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stopping = true;
+		}
+		condition.notify_all();
+		for (auto &worker : workers)
+			worker.join();
+	}
+
+	ThreadPool(const ThreadPool &) = delete;
+	ThreadPool &operator=(const ThreadPool &) = delete;
+
+	template<typename Task>
+	std::future<typename std::result_of<Task()>::type> enqueue(Task task) {
+		typedef typename std::result_of<Task()>::type Result;
+		auto packaged = std::make_shared<std::packaged_task<Result()>>(std::move(task));
+		std::future<Result> result = packaged->get_future();
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			tasks.push([packaged] { (*packaged)(); });
+		}
+		condition.notify_one();
+		return result;
+	}
+
+	size_t size() const {
+		return workers.size();
+	}
+
+private:
+	std::vector<std::thread> workers;
+	std::queue<std::function<void()>> tasks;
+	std::mutex mutex;
+	std::condition_variable condition;
+	bool stopping = false;
+
+	void work() {
+		for (;;) {
+			std::function<void()> task;
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				condition.wait(lock, [this] { return stopping || !tasks.empty(); });
+				if (tasks.empty())
+					return;
+				task = std::move(tasks.front());
+				tasks.pop();
+			}
+			task();
+		}
+	}
+};
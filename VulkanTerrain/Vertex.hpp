@@ -0,0 +1,7 @@
+#pragma once
+
+// Matches the std430 layout of Vertex in BuildMesh.comp
+struct Vertex {
+	float pos[4];
+	float norm[4];
+};
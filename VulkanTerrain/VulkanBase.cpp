@@ -2,15 +2,55 @@
 
 VulkanBase::VulkanBase(bool enableValidation) {
 	for (int32_t i = 0; i < __argc; i++)
+	{
 		if (__argv[i] == std::string("-validation"))
 			enableValidation = true;
+		if (__argv[i] == std::string("-headless"))
+			headless = true;
+		// Benchmarks always run headless
+		if (__argv[i] == std::string("-benchmark"))
+			benchmark = headless = true;
+		if (__argv[i] == std::string("-profile"))
+			profile = true;
+	}
 	initVulkan(enableValidation);
-	if (enableValidation)
+	// Headless runs keep writing to stdout when it was redirected, e.g. by a CI job
+	if (enableValidation || ((headless || profile) && GetStdHandle(STD_OUTPUT_HANDLE) == NULL))
 		setupConsole("VulkanTerrain");
 }
 
+VulkanBase::VulkanBase(VulkanBase *owner) {
+	sharedDevice = true;
+	enableValidation = owner->enableValidation;
+	headless = owner->headless;
+	benchmark = owner->benchmark;
+	profile = owner->profile;
+
+	instance = owner->instance;
+	physicalDevice = owner->physicalDevice;
+	deviceProperties = owner->deviceProperties;
+	deviceMemoryProperties = owner->deviceMemoryProperties;
+	deviceFeatures = owner->deviceFeatures;
+	enabledFeatures = owner->enabledFeatures;
+	device = owner->device;
+	queue = owner->queue;
+	computeQueue = owner->computeQueue;
+	queueFamilyIndices = owner->queueFamilyIndices;
+	depthFormat = owner->depthFormat;
+	allocator = owner->allocator;
+
+	if (!headless)
+		swapChain.connect(instance, physicalDevice, device);
+	createSyncObjects();
+}
+
 VulkanBase::~VulkanBase() {
-	swapChain.cleanup();
+	// Frames may still be in flight
+	vkDeviceWaitIdle(device);
+
+	// The generator never creates a swapchain of its own
+	if (swapChain.swapChain != VK_NULL_HANDLE)
+		swapChain.cleanup();
 	vkDestroyDescriptorPool(device, descriptorPool, nullptr);
 
 	if (setupCmdBuffer != VK_NULL_HANDLE)
@@ -27,17 +67,33 @@ VulkanBase::~VulkanBase() {
 
 	vkDestroyImageView(device, depthStencil.view, nullptr);
 	vkDestroyImage(device, depthStencil.image, nullptr);
-	vkFreeMemory(device, depthStencil.mem, nullptr);
+	if (allocator != nullptr)
+		allocator->free(depthStencil.mem);
 
-	vkDestroyPipelineCache(device, pipelineCache, nullptr);
+	if (pipelineCache != VK_NULL_HANDLE) {
+		savePipelineCache();
+		vkDestroyPipelineCache(device, pipelineCache, nullptr);
+	}
 
 	if (textureLoader)
 		delete textureLoader;
 
 	vkDestroyCommandPool(device, cmdPool, nullptr);
 
-	vkDestroySemaphore(device, semaphores.presentComplete, nullptr);
-	vkDestroySemaphore(device, semaphores.renderComplete, nullptr);
+	delete profiler;
+
+	delete uniforms;
+
+	for (auto &frame : frames) {
+		vkDestroySemaphore(device, frame.presentComplete, nullptr);
+		vkDestroySemaphore(device, frame.renderComplete, nullptr);
+		vkDestroyFence(device, frame.fence, nullptr);
+	}
+
+	if (sharedDevice)
+		return;
+
+	delete allocator;
 
 	vkDestroyDevice(device, nullptr);
 
@@ -56,17 +112,20 @@ VkResult VulkanBase::createInstance(bool enableValidation) {
 	appInfo.pEngineName = name.c_str();
 	appInfo.apiVersion = VK_MAKE_VERSION(1, 0, 7);
 
-	std::vector<const char*> enabledExtensions = {VK_KHR_SURFACE_EXTENSION_NAME};
-
-	enabledExtensions.push_back(VK_KHR_WIN32_SURFACE_EXTENSION_NAME);
+	// Headless instances never present, so they also run on drivers without window system integration
+	std::vector<const char*> enabledExtensions;
+	if (!headless) {
+		enabledExtensions.push_back(VK_KHR_SURFACE_EXTENSION_NAME);
+		enabledExtensions.push_back(VK_KHR_WIN32_SURFACE_EXTENSION_NAME);
+	}
+	if (enableValidation)
+		enabledExtensions.push_back(VK_EXT_DEBUG_REPORT_EXTENSION_NAME);
 
 	VkInstanceCreateInfo instanceCreateInfo = {};
 	instanceCreateInfo.sType = VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO;
 	instanceCreateInfo.pNext = NULL;
 	instanceCreateInfo.pApplicationInfo = &appInfo;
 	if (enabledExtensions.size() > 0){
-		if (enableValidation)
-			enabledExtensions.push_back(VK_EXT_DEBUG_REPORT_EXTENSION_NAME);
 		instanceCreateInfo.enabledExtensionCount = (uint32_t)enabledExtensions.size();
 		instanceCreateInfo.ppEnabledExtensionNames = enabledExtensions.data();
 	}
@@ -77,15 +136,20 @@ VkResult VulkanBase::createInstance(bool enableValidation) {
 	return vkCreateInstance(&instanceCreateInfo, nullptr, &instance);
 }
 
-VkResult VulkanBase::createDevice(VkDeviceQueueCreateInfo requestedQueues, bool enableValidation) {
-	std::vector<const char*> enabledExtensions = { VK_KHR_SWAPCHAIN_EXTENSION_NAME };
+VkResult VulkanBase::createDevice(std::vector<VkDeviceQueueCreateInfo> requestedQueues, bool enableValidation) {
+	std::vector<const char*> enabledExtensions;
+	if (!headless)
+		enabledExtensions.push_back(VK_KHR_SWAPCHAIN_EXTENSION_NAME);
 
 	VkDeviceCreateInfo deviceCreateInfo = {};
 	deviceCreateInfo.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
 	deviceCreateInfo.pNext = NULL;
-	deviceCreateInfo.queueCreateInfoCount = 1;
-	deviceCreateInfo.pQueueCreateInfos = &requestedQueues;
-	deviceCreateInfo.pEnabledFeatures = NULL;
+	deviceCreateInfo.queueCreateInfoCount = (uint32_t)requestedQueues.size();
+	deviceCreateInfo.pQueueCreateInfos = requestedQueues.data();
+	vkGetPhysicalDeviceFeatures(physicalDevice, &deviceFeatures);
+	// Terrain chunks are drawn with a single indirect call when available
+	enabledFeatures.multiDrawIndirect = deviceFeatures.multiDrawIndirect;
+	deviceCreateInfo.pEnabledFeatures = &enabledFeatures;
 
 	if (enabledExtensions.size() > 0){
 		deviceCreateInfo.enabledExtensionCount = (uint32_t)enabledExtensions.size();
@@ -124,19 +188,12 @@ void VulkanBase::createCommandBuffers() {
 
 	vkTools::checkResult(vkAllocateCommandBuffers(device, &cmdBufAllocateInfo, drawCmdBuffers.data()));
 
-	// Command buffers for submitting present barriers
-	cmdBufAllocateInfo.commandBufferCount = 1;
-	// Pre present
-	vkTools::checkResult(vkAllocateCommandBuffers(device, &cmdBufAllocateInfo, &prePresentCmdBuffer));
-
-	// Post present
-	vkTools::checkResult(vkAllocateCommandBuffers(device, &cmdBufAllocateInfo, &postPresentCmdBuffer));
+	imageFences.assign(drawCmdBuffers.size(), VK_NULL_HANDLE);
 }
 
 void VulkanBase::destroyCommandBuffers() {
-	vkFreeCommandBuffers(device, cmdPool, (uint32_t)drawCmdBuffers.size(), drawCmdBuffers.data());
-	vkFreeCommandBuffers(device, cmdPool, 1, &prePresentCmdBuffer);
-	vkFreeCommandBuffers(device, cmdPool, 1, &postPresentCmdBuffer);
+	if (!drawCmdBuffers.empty())
+		vkFreeCommandBuffers(device, cmdPool, (uint32_t)drawCmdBuffers.size(), drawCmdBuffers.data());
 }
 
 void VulkanBase::createSetupCommandBuffer() {
@@ -178,14 +235,67 @@ void VulkanBase::flushSetupCommandBuffer() {
 	setupCmdBuffer = VK_NULL_HANDLE;
 }
 
+std::string VulkanBase::getPipelineCacheFileName() {
+	return name + ".pipelinecache";
+}
+
 void VulkanBase::createPipelineCache() {
+	// Start from the pipelines compiled by the previous run, unless they were built by a different device or driver
+	std::vector<char> cacheData;
+	std::ifstream file(getPipelineCacheFileName(), std::ios::binary | std::ios::ate);
+	if (file.is_open()) {
+		cacheData.resize((size_t)file.tellg());
+		file.seekg(0);
+		file.read(cacheData.data(), cacheData.size());
+		if (!file || !isPipelineCacheValid(cacheData))
+			cacheData.clear();
+	}
+
 	VkPipelineCacheCreateInfo pipelineCacheCreateInfo = {};
 	pipelineCacheCreateInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO;
+	pipelineCacheCreateInfo.initialDataSize = cacheData.size();
+	pipelineCacheCreateInfo.pInitialData = cacheData.empty() ? nullptr : cacheData.data();
 	vkTools::checkResult(vkCreatePipelineCache(device, &pipelineCacheCreateInfo, nullptr, &pipelineCache));
 }
 
+bool VulkanBase::isPipelineCacheValid(const std::vector<char> &cacheData) {
+	// Header of version one: length, version, vendor ID, device ID and the cache UUID
+	const size_t headerSize = 4 * sizeof(uint32_t) + VK_UUID_SIZE;
+	if (cacheData.size() < headerSize)
+		return false;
+	uint32_t header[4];
+	memcpy(header, cacheData.data(), sizeof(header));
+	return header[0] >= headerSize &&
+		header[1] == VK_PIPELINE_CACHE_HEADER_VERSION_ONE &&
+		header[2] == deviceProperties.vendorID &&
+		header[3] == deviceProperties.deviceID &&
+		memcmp(cacheData.data() + sizeof(header), deviceProperties.pipelineCacheUUID, VK_UUID_SIZE) == 0;
+}
+
+void VulkanBase::savePipelineCache() {
+	size_t size = 0;
+	vkTools::checkResult(vkGetPipelineCacheData(device, pipelineCache, &size, nullptr));
+	std::vector<char> cacheData(size);
+	vkTools::checkResult(vkGetPipelineCacheData(device, pipelineCache, &size, cacheData.data()));
+
+	// Written to a temporary file first so that an interrupted write doesn't leave a truncated cache behind
+	std::string fileName = getPipelineCacheFileName();
+	std::string tempFileName = fileName + ".tmp";
+	{
+		std::ofstream file(tempFileName, std::ios::binary | std::ios::trunc);
+		if (!file.is_open())
+			return;
+		file.write(cacheData.data(), size);
+		if (!file)
+			return;
+	}
+	// Replaces the old cache in one step, readers see either the old or the new file
+	if (!MoveFileExA(tempFileName.c_str(), fileName.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH))
+		std::remove(tempFileName.c_str());
+}
+
 void VulkanBase::prepare() {
-	if (enableValidation)
+	if (enableValidation && !sharedDevice)
 		vkDebug::setupDebugging(instance, VK_DEBUG_REPORT_ERROR_BIT_EXT | VK_DEBUG_REPORT_WARNING_BIT_EXT, NULL);
 	createCommandPool();
 	createSetupCommandBuffer();
@@ -199,7 +309,7 @@ void VulkanBase::prepare() {
 	// Recreate setup command buffer for derived class
 	createSetupCommandBuffer();
 	// Create a simple texture loader class
-	textureLoader = new vkTools::VulkanTextureLoader(physicalDevice, device, queue, cmdPool);
+	textureLoader = new vkTools::VulkanTextureLoader(physicalDevice, device, queue, cmdPool, allocator);
 }
 
 VkPipelineShaderStageCreateInfo VulkanBase::loadShader(std::string fileName, VkShaderStageFlagBits stage) {
@@ -218,28 +328,16 @@ VkBool32 VulkanBase::createBuffer(
 	VkDeviceSize size,
 	void *data,
 	VkBuffer *buffer,
-	VkDeviceMemory *memory) 
+	vkTools::Allocation *memory) 
 {
-	VkMemoryRequirements memReqs;
-	VkMemoryAllocateInfo memAlloc = vkTools::initializers::memoryAllocateInfo();
 	VkBufferCreateInfo bufferCreateInfo = vkTools::initializers::bufferCreateInfo(usage, size);
 
 	VkResult err = vkCreateBuffer(device, &bufferCreateInfo, nullptr, buffer);
 	assert(!err);
-	vkGetBufferMemoryRequirements(device, *buffer, &memReqs);
-	memAlloc.allocationSize = memReqs.size;
-	getMemoryType(memReqs.memoryTypeBits, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT, &memAlloc.memoryTypeIndex);
-	err = vkAllocateMemory(device, &memAlloc, nullptr, memory);
-	assert(!err);
-	if (data != nullptr){
-		void *mapped;
-		err = vkMapMemory(device, *memory, 0, size, 0, &mapped);
-		assert(!err);
-		memcpy(mapped, data, size);
-		vkUnmapMemory(device, *memory);
-	}
-	err = vkBindBufferMemory(device, *buffer, *memory, 0);
-	assert(!err);
+	// Coherent so that buffers can stay mapped and be written without flushing
+	*memory = allocator->allocateBuffer(*buffer, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+	if (data != nullptr)
+		memcpy(memory->mapped, data, size);
 	return true;
 }
 
@@ -248,7 +346,7 @@ VkBool32 VulkanBase::createBuffer(
 	VkDeviceSize size, 
 	void * data, 
 	VkBuffer * buffer, 
-	VkDeviceMemory * memory, 
+	vkTools::Allocation * memory, 
 	VkDescriptorBufferInfo * descriptor)
 {
 	VkBool32 res = createBuffer(usage, size, data, buffer, memory);
@@ -277,41 +375,48 @@ VkBool32 VulkanBase::getMemoryType(uint32_t typeBits, VkFlags properties, uint32
 }
 
 void VulkanBase::renderLoop() {
-	MSG msg;
 	while (doRender){
-		auto tStart = std::chrono::high_resolution_clock::now();
-		if (PeekMessage(&msg, NULL, 0, 0, PM_REMOVE)){
-			if (msg.message == WM_QUIT)
-				break;
-			else {
-				TranslateMessage(&msg);
-				DispatchMessage(&msg);
-			}
-		}
-		render();
-		frameCounter++;
-		auto tEnd = std::chrono::high_resolution_clock::now();
-		auto tDiff = std::chrono::duration<double, std::milli>(tEnd - tStart).count();
-		frameTimer = (float)tDiff / 1000.0f;
-		// Convert to clamped timer value
-		timer += timerSpeed * frameTimer;
-		if (timer > 1.0)
-			timer -= 1.0f;
-		fpsTimer += (float)tDiff;
-		if (fpsTimer > 1000.0f){
-			std::string windowTitle = getWindowTitle();
-			SetWindowText(window, windowTitle.c_str());
-			fpsTimer = 0.0f;
-			frameCounter = 0.0f;
-		}
+		if (!renderFrame())
+			break;
 	}
 }
 
-void VulkanBase::submitPrePresentBarrier(VkImage image) {
-	VkCommandBufferBeginInfo cmdBufInfo = vkTools::initializers::commandBufferBeginInfo();
-
-	vkTools::checkResult(vkBeginCommandBuffer(prePresentCmdBuffer, &cmdBufInfo));
+bool VulkanBase::renderFrame() {
+	MSG msg;
+	auto tStart = std::chrono::high_resolution_clock::now();
+	if (PeekMessage(&msg, NULL, 0, 0, PM_REMOVE)){
+		if (msg.message == WM_QUIT)
+			return false;
+		else {
+			TranslateMessage(&msg);
+			DispatchMessage(&msg);
+		}
+	}
+	render();
+	frameCounter++;
+	auto tEnd = std::chrono::high_resolution_clock::now();
+	auto tDiff = std::chrono::duration<double, std::milli>(tEnd - tStart).count();
+	frameTimer = (float)tDiff / 1000.0f;
+	// Convert to clamped timer value
+	timer += timerSpeed * frameTimer;
+	if (timer > 1.0)
+		timer -= 1.0f;
+	fpsTimer += (float)tDiff;
+	if (fpsTimer > 1000.0f){
+		std::string windowTitle = getWindowTitle();
+		SetWindowText(window, windowTitle.c_str());
+		if (profiler != nullptr)
+			profiler->report(std::cout);
+		if (profile)
+			allocator->report(std::cout);
+		fpsTimer = 0.0f;
+		frameCounter = 0.0f;
+	}
+	return true;
+}
 
+// Recorded at the end of the draw command buffer of each swapchain image
+void VulkanBase::addPrePresentBarrier(VkCommandBuffer cmdBuffer, VkImage image) {
 	VkImageMemoryBarrier prePresentBarrier = vkTools::initializers::imageMemoryBarrier();
 	prePresentBarrier.srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
 	prePresentBarrier.dstAccessMask = 0;
@@ -323,28 +428,17 @@ void VulkanBase::submitPrePresentBarrier(VkImage image) {
 	prePresentBarrier.image = image;
 
 	vkCmdPipelineBarrier(
-		prePresentCmdBuffer,
-		VK_PIPELINE_STAGE_ALL_COMMANDS_BIT,
-		VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+		cmdBuffer,
+		VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
+		VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
 		VK_FLAGS_NONE,
 		0, nullptr, // No memory barriers,
 		0, nullptr, // No buffer barriers,
 		1, &prePresentBarrier);
-
-	vkTools::checkResult(vkEndCommandBuffer(prePresentCmdBuffer));
-
-	VkSubmitInfo submitInfo = vkTools::initializers::submitInfo();
-	submitInfo.commandBufferCount = 1;
-	submitInfo.pCommandBuffers = &prePresentCmdBuffer;
-
-	vkTools::checkResult(vkQueueSubmit(queue, 1, &submitInfo, VK_NULL_HANDLE));
 }
 
-void VulkanBase::submitPostPresentBarrier(VkImage image) {
-	VkCommandBufferBeginInfo cmdBufInfo = vkTools::initializers::commandBufferBeginInfo();
-
-	vkTools::checkResult(vkBeginCommandBuffer(postPresentCmdBuffer, &cmdBufInfo));
-
+// Recorded at the start of the draw command buffer of each swapchain image
+void VulkanBase::addPostPresentBarrier(VkCommandBuffer cmdBuffer, VkImage image) {
 	VkImageMemoryBarrier postPresentBarrier = vkTools::initializers::imageMemoryBarrier();
 	postPresentBarrier.srcAccessMask = 0;
 	postPresentBarrier.dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
@@ -356,21 +450,13 @@ void VulkanBase::submitPostPresentBarrier(VkImage image) {
 	postPresentBarrier.image = image;
 
 	vkCmdPipelineBarrier(
-		postPresentCmdBuffer,
-		VK_PIPELINE_STAGE_ALL_COMMANDS_BIT,
-		VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+		cmdBuffer,
+		VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
+		VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
 		0,
 		0, nullptr, // No memory barriers,
 		0, nullptr, // No buffer barriers,
 		1, &postPresentBarrier);
-
-	vkTools::checkResult(vkEndCommandBuffer(postPresentCmdBuffer));
-
-	VkSubmitInfo submitInfo = vkTools::initializers::submitInfo();
-	submitInfo.commandBufferCount = 1;
-	submitInfo.pCommandBuffers = &postPresentCmdBuffer;
-
-	vkTools::checkResult(vkQueueSubmit(queue, 1, &submitInfo, VK_NULL_HANDLE));
 }
 
 VkSubmitInfo VulkanBase::prepareSubmitInfo(
@@ -380,11 +466,11 @@ VkSubmitInfo VulkanBase::prepareSubmitInfo(
 	VkSubmitInfo submitInfo = vkTools::initializers::submitInfo();
 	submitInfo.pWaitDstStageMask = pipelineStages;
 	submitInfo.waitSemaphoreCount = 1;
-	submitInfo.pWaitSemaphores = &semaphores.presentComplete;
+	submitInfo.pWaitSemaphores = &frames[currentFrame].presentComplete;
 	submitInfo.commandBufferCount = commandBuffers.size();
 	submitInfo.pCommandBuffers = commandBuffers.data();
 	submitInfo.signalSemaphoreCount = 1;
-	submitInfo.pSignalSemaphores = &semaphores.renderComplete;
+	submitInfo.pSignalSemaphores = &frames[currentFrame].renderComplete;
 	return submitInfo;
 }
 
@@ -417,41 +503,80 @@ void VulkanBase::initVulkan(bool enableValidation) {
 			break;
 	assert(graphicsQueueIndex < queueCount);
 
-	std::array<float, 1> queuePriorities = { 0.0f };
-	VkDeviceQueueCreateInfo queueCreateInfo = {};
-	queueCreateInfo.sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
-	queueCreateInfo.queueFamilyIndex = graphicsQueueIndex;
-	queueCreateInfo.queueCount = 1;
-	queueCreateInfo.pQueuePriorities = queuePriorities.data();
+	// Prefer a compute only family so that chunk generation runs asynchronously to rendering,
+	// otherwise fall back to a second queue of the graphics family or share the graphics queue
+	uint32_t computeQueueIndex;
+	for (computeQueueIndex = 0; computeQueueIndex < queueCount; computeQueueIndex++)
+		if ((queueProps[computeQueueIndex].queueFlags & VK_QUEUE_COMPUTE_BIT) && !(queueProps[computeQueueIndex].queueFlags & VK_QUEUE_GRAPHICS_BIT))
+			break;
+	if (computeQueueIndex == queueCount)
+		computeQueueIndex = graphicsQueueIndex;
+	queueFamilyIndices.graphics = graphicsQueueIndex;
+	queueFamilyIndices.compute = computeQueueIndex;
+
+	std::array<float, 2> queuePriorities = { 0.0f, 0.0f };
+	std::vector<VkDeviceQueueCreateInfo> queueCreateInfos(1);
+	queueCreateInfos[0] = {};
+	queueCreateInfos[0].sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
+	queueCreateInfos[0].queueFamilyIndex = graphicsQueueIndex;
+	queueCreateInfos[0].queueCount = 1;
+	queueCreateInfos[0].pQueuePriorities = queuePriorities.data();
+	if (computeQueueIndex != graphicsQueueIndex) {
+		VkDeviceQueueCreateInfo computeQueueCreateInfo = queueCreateInfos[0];
+		computeQueueCreateInfo.queueFamilyIndex = computeQueueIndex;
+		queueCreateInfos.push_back(computeQueueCreateInfo);
+	}
+	else if (queueProps[graphicsQueueIndex].queueCount > 1)
+		queueCreateInfos[0].queueCount = 2;
 
-	err = createDevice(queueCreateInfo, enableValidation);
+	err = createDevice(queueCreateInfos, enableValidation);
 	assert(!err);
 
 	vkGetPhysicalDeviceProperties(physicalDevice, &deviceProperties);
 
 	vkGetPhysicalDeviceMemoryProperties(physicalDevice, &deviceMemoryProperties);
 
+	allocator = new vkTools::VulkanAllocator(physicalDevice, device);
+
 	vkGetDeviceQueue(device, graphicsQueueIndex, 0, &queue);
+	if (computeQueueIndex != graphicsQueueIndex)
+		vkGetDeviceQueue(device, computeQueueIndex, 0, &computeQueue);
+	else
+		vkGetDeviceQueue(device, graphicsQueueIndex, queueCreateInfos[0].queueCount - 1, &computeQueue);
 
 	VkBool32 validDepthFormat = vkTools::getSupportedDepthFormat(physicalDevice, &depthFormat);
 	assert(validDepthFormat);
 
-	swapChain.connect(instance, physicalDevice, device);
+	if (!headless)
+		swapChain.connect(instance, physicalDevice, device);
 
+	createSyncObjects();
+}
+
+void VulkanBase::createSyncObjects() {
+	VkResult err;
 	VkSemaphoreCreateInfo semaphoreCreateInfo = vkTools::initializers::semaphoreCreateInfo();
 
-	err = vkCreateSemaphore(device, &semaphoreCreateInfo, nullptr, &semaphores.presentComplete);
-	assert(!err);
+	// Fences start signalled so that the first use of each frame doesn't wait
+	VkFenceCreateInfo fenceCreateInfo = vkTools::initializers::fenceCreateInfo(VK_FENCE_CREATE_SIGNALED_BIT);
 
-	err = vkCreateSemaphore(device, &semaphoreCreateInfo, nullptr, &semaphores.renderComplete);
-	assert(!err);
+	for (auto &frame : frames) {
+		err = vkCreateSemaphore(device, &semaphoreCreateInfo, nullptr, &frame.presentComplete);
+		assert(!err);
+
+		err = vkCreateSemaphore(device, &semaphoreCreateInfo, nullptr, &frame.renderComplete);
+		assert(!err);
+
+		err = vkCreateFence(device, &fenceCreateInfo, nullptr, &frame.fence);
+		assert(!err);
+	}
 
 	submitInfo = vkTools::initializers::submitInfo();
 	submitInfo.pWaitDstStageMask = &submitPipelineStages;
 	submitInfo.waitSemaphoreCount = 1;
-	submitInfo.pWaitSemaphores = &semaphores.presentComplete;
+	submitInfo.pWaitSemaphores = &frames[currentFrame].presentComplete;
 	submitInfo.signalSemaphoreCount = 1;
-	submitInfo.pSignalSemaphores = &semaphores.renderComplete;
+	submitInfo.pSignalSemaphores = &frames[currentFrame].renderComplete;
 }
 
 void VulkanBase::setupConsole(std::string title) {
@@ -587,7 +712,8 @@ void VulkanBase::handleMessages(HWND hWnd, UINT uMsg, WPARAM wParam, LPARAM lPar
 void VulkanBase::createCommandPool() {
 	VkCommandPoolCreateInfo cmdPoolInfo = {};
 	cmdPoolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
-	cmdPoolInfo.queueFamilyIndex = swapChain.queueNodeIndex;
+	// Everything from this pool is submitted to queue, which also presents
+	cmdPoolInfo.queueFamilyIndex = queueFamilyIndices.graphics;
 	cmdPoolInfo.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
 	vkTools::checkResult(vkCreateCommandPool(device, &cmdPoolInfo, nullptr, &cmdPool));
 }
@@ -603,15 +729,10 @@ void VulkanBase::setupDepthStencil() {
 	image.arrayLayers = 1;
 	image.samples = VK_SAMPLE_COUNT_1_BIT;
 	image.tiling = VK_IMAGE_TILING_OPTIMAL;
-	image.usage = VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT;
+	// Sampled when building the depth pyramid for occlusion culling
+	image.usage = VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT | VK_IMAGE_USAGE_SAMPLED_BIT;
 	image.flags = 0;
 
-	VkMemoryAllocateInfo mem_alloc = {};
-	mem_alloc.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-	mem_alloc.pNext = NULL;
-	mem_alloc.allocationSize = 0;
-	mem_alloc.memoryTypeIndex = 0;
-
 	VkImageViewCreateInfo depthStencilView = {};
 	depthStencilView.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
 	depthStencilView.pNext = NULL;
@@ -625,15 +746,8 @@ void VulkanBase::setupDepthStencil() {
 	depthStencilView.subresourceRange.baseArrayLayer = 0;
 	depthStencilView.subresourceRange.layerCount = 1;
 
-	VkMemoryRequirements memReqs;
-
 	vkTools::checkResult(vkCreateImage(device, &image, nullptr, &depthStencil.image));
-	vkGetImageMemoryRequirements(device, depthStencil.image, &memReqs);
-	mem_alloc.allocationSize = memReqs.size;
-	getMemoryType(memReqs.memoryTypeBits, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &mem_alloc.memoryTypeIndex);
-	vkTools::checkResult(vkAllocateMemory(device, &mem_alloc, nullptr, &depthStencil.mem));
-
-	vkTools::checkResult(vkBindImageMemory(device, depthStencil.image, depthStencil.mem, 0));
+	depthStencil.mem = allocator->allocateImage(depthStencil.image, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
 	vkTools::setImageLayout(
 		setupCmdBuffer,
 		depthStencil.image,
@@ -5,6 +5,8 @@
 #include <io.h>
 
 #include <iostream>
+#include <fstream>
+#include <cstdio>
 #include <chrono>
 
 #define GLM_FORCE_RADIANS
@@ -18,50 +20,89 @@
 
 #include "base/vulkantools.h"
 #include "base/vulkandebug.h"
+#include "base/vulkanallocator.hpp"
 #include "base/vulkanTextureLoader.hpp"
 
 #include "base/vulkanswapchain.hpp"
 
+#include "GpuProfiler.hpp"
+#include "PerImageUniforms.hpp"
+
 class VulkanBase {
 private:
 	float fpsTimer = 0.0f;
 	VkResult createInstance(bool enableValidation);
-	VkResult createDevice(VkDeviceQueueCreateInfo requestedQueues, bool enableValidation);
+	VkResult createDevice(std::vector<VkDeviceQueueCreateInfo> requestedQueues, bool enableValidation);
+	void createSyncObjects();
 	std::string getWindowTitle();
+	std::string getPipelineCacheFileName();
+	bool isPipelineCacheValid(const std::vector<char> &cacheData);
+	void savePipelineCache();
 protected:
 	bool enableValidation = false;
+	// Set when instance, device, queues and allocator belong to another VulkanBase, see VulkanBase(VulkanBase*)
+	bool sharedDevice = false;
 	float frameTimer = 1.0f;
 	uint32_t frameCounter = 0;
 	VkInstance instance;
 	VkPhysicalDevice physicalDevice;
 	VkPhysicalDeviceProperties deviceProperties;
 	VkPhysicalDeviceMemoryProperties deviceMemoryProperties;
+	VkPhysicalDeviceFeatures deviceFeatures;
+	// Subset of deviceFeatures enabled on the logical device
+	VkPhysicalDeviceFeatures enabledFeatures = {};
 	VkDevice device;
 	VkQueue queue;
+	// Chunk generation runs on its own queue, preferably from a compute only family
+	VkQueue computeQueue;
+	struct {
+		uint32_t graphics;
+		uint32_t compute;
+	} queueFamilyIndices;
 	VkFormat colorFormat = VK_FORMAT_B8G8R8A8_UNORM;
 	VkFormat depthFormat;
 	VkCommandPool cmdPool;
 	VkCommandBuffer setupCmdBuffer = VK_NULL_HANDLE;
-	VkCommandBuffer postPresentCmdBuffer = VK_NULL_HANDLE;
-	VkCommandBuffer prePresentCmdBuffer = VK_NULL_HANDLE;
-	VkPipelineStageFlags submitPipelineStages = VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT;
+	// Only writing to the swapchain image has to wait for it to be acquired, culling can start earlier
+	VkPipelineStageFlags submitPipelineStages = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
 	VkSubmitInfo submitInfo;
 	std::vector<VkCommandBuffer> drawCmdBuffers;
-	VkRenderPass renderPass;
+	VkRenderPass renderPass = VK_NULL_HANDLE;
 	std::vector<VkFramebuffer> frameBuffers;
 	uint32_t currentBuffer = 0;
 	VkDescriptorPool descriptorPool;
 	std::vector<VkShaderModule> shaderModules;
-	VkPipelineCache pipelineCache;
+	// Loaded from and saved to getPipelineCacheFileName(), so pipelines are only compiled on the first run
+	VkPipelineCache pipelineCache = VK_NULL_HANDLE;
 	VulkanSwapChain swapChain;
-	struct {
+	// Number of frames the CPU may record ahead of the GPU
+	static const uint32_t MAX_FRAMES_IN_FLIGHT = 2;
+	struct FrameSync {
 		VkSemaphore presentComplete;
 		VkSemaphore renderComplete;
-	} semaphores;
+		// Signalled once the frame's submission has finished executing
+		VkFence fence;
+	};
+	std::array<FrameSync, MAX_FRAMES_IN_FLIGHT> frames;
+	uint32_t currentFrame = 0;
+	// Fence of the frame that last rendered into each swapchain image
+	std::vector<VkFence> imageFences;
+	// Device memory of all resources is sub-allocated from here
+	vkTools::VulkanAllocator *allocator = nullptr;
 	vkTools::VulkanTextureLoader *textureLoader = nullptr;
+	// GPU timings of the command buffers of the derived class, created by it when profile is set
+	GpuProfiler *profiler = nullptr;
+	// Uniform data of the derived class
+	PerImageUniforms *uniforms = nullptr;
 public:
 	bool prepared = false;
 	bool doRender = true;
+	// Set with -headless: no window, surface or swapchain is created and nothing is presented
+	bool headless = false;
+	// Set with -benchmark, implies headless
+	bool benchmark = false;
+	// Set with -profile, GPU timings are written to stdout once per second
+	bool profile = false;
 	uint32_t width = 1280;
 	uint32_t height = 720;
 
@@ -74,9 +115,9 @@ public:
 	std::string name = "vulkanBase";
 
 	struct {
-		VkImage image;
-		VkDeviceMemory mem;
-		VkImageView view;
+		VkImage image = VK_NULL_HANDLE;
+		vkTools::Allocation mem;
+		VkImageView view = VK_NULL_HANDLE;
 	} depthStencil;
 
 	HWND window;
@@ -84,6 +125,9 @@ public:
 
 	VulkanBase(bool enableValidation);
 	VulkanBase() : VulkanBase(false) {};
+	// Uses the instance, device, queues and allocator of owner, which has to outlive this one.
+	// Everything created on top of the device, like the swapchain and command pools, is still its own
+	VulkanBase(VulkanBase *owner);
 	~VulkanBase();
 
 	void initVulkan(bool enableValidation);
@@ -122,20 +166,22 @@ public:
 		VkDeviceSize size,
 		void *data,
 		VkBuffer *buffer,
-		VkDeviceMemory *memory);
+		vkTools::Allocation *memory);
 
 	VkBool32 createBuffer(
 		VkBufferUsageFlags usage, 
 		VkDeviceSize size,
 		void *data,
 		VkBuffer *buffer,
-		VkDeviceMemory *memory,
+		vkTools::Allocation *memory,
 		VkDescriptorBufferInfo *descriptor);
 
 	void renderLoop();
+	// Runs a single iteration of the render loop, returns false once the window was closed
+	bool renderFrame();
 
-	void submitPrePresentBarrier(VkImage image);
-	void submitPostPresentBarrier(VkImage image);
+	void addPrePresentBarrier(VkCommandBuffer cmdBuffer, VkImage image);
+	void addPostPresentBarrier(VkCommandBuffer cmdBuffer, VkImage image);
 
 	VkSubmitInfo prepareSubmitInfo(
 		std::vector<VkCommandBuffer> commandBuffers,
@@ -1,64 +1,583 @@
 #include "VulkanTerrain.h"
 
-VulkanTerrain::VulkanTerrain(bool enableValidation) {
-	meshRenderer = new Mesh(enableValidation);
+VulkanTerrain::VulkanTerrain(bool enableValidation)
+	: chunkManager(glm::ivec3(VISIBILITY_DISTANCE, VISIBILITY_DISTANCE, VISIBILITY_DISTANCE / 2), LOD_RING_WIDTH) {
+	name = "terrainGenerator";
+	if (!headless)
+		meshRenderer = new Mesh(this);
+	for (int32_t i = 0; i < __argc; i++) {
+		if (__argv[i] == std::string("-cpumesher"))
+			cpuMesher = new CpuMesher();
+		if (__argv[i] == std::string("-workgroup") && i + 1 < __argc) {
+			glm::uvec3 size;
+			if (sscanf(__argv[i + 1], "%ux%ux%u", &size.x, &size.y, &size.z) == 3)
+				meshWorkgroupSize = size;
+		}
+	}
 }
 
 VulkanTerrain::~VulkanTerrain() {
-
+	delete cpuMesher;
+	// Also writes the renderer's pipeline cache
+	delete meshRenderer;
 }
 
 void VulkanTerrain::loadMesh() {
-	std::vector<Vertex> vertexBuffer;
-	std::vector<uint32_t> indexBuffer;
-	std::vector<Chunk> chunks;
+	// Released slots are handed out again once no frame in flight can draw from them
+	if (!retiringArenaSlots.empty()) {
+		uint64_t completedFrames = meshRenderer->completedFrames();
+		auto retired = std::partition(retiringArenaSlots.begin(), retiringArenaSlots.end(), [completedFrames](const std::pair<uint64_t, uint32_t> &slot) {
+			return slot.first > completedFrames;
+		});
+		for (auto slot = retired; slot != retiringArenaSlots.end(); ++slot)
+			freeArenaSlots.push_back(slot->second);
+		retiringArenaSlots.erase(retired, retiringArenaSlots.end());
+	}
 
-	int pos[3] = { (int)meshRenderer->cam->pos.x%Chunk::CHUNK_SIZE, (int)meshRenderer->cam->pos.y%Chunk::CHUNK_SIZE, (int)meshRenderer->cam->pos.z%Chunk::CHUNK_SIZE };
-	for (int x = pos[0] - (CHUNK_COUNT / 2)*Chunk::CHUNK_SIZE; x < pos[0] + (CHUNK_COUNT / 2)*Chunk::CHUNK_SIZE; ++x) {
-		for (int y = pos[1] - (CHUNK_COUNT / 2)*Chunk::CHUNK_SIZE; y < pos[1] + (CHUNK_COUNT / 2)*Chunk::CHUNK_SIZE; ++y) {
-			for (int z = pos[2] - (CHUNK_COUNT / 2)*Chunk::CHUNK_SIZE; z < pos[2] + (CHUNK_COUNT / 2)*Chunk::CHUNK_SIZE; ++z) {
-				chunks.push_back(Chunk(x, y, z));
-			}
+	// Generation never blocks rendering: a finished batch is picked up on the next call and
+	// the window is only moved while no batch is in flight
+	if (computeInFlight) {
+		if (vkGetFenceStatus(device, computeFence) != VK_SUCCESS)
+			return;
+		vkTools::checkResult(vkResetFences(device, 1, &computeFence));
+		computeInFlight = false;
+		if (profiler != nullptr)
+			profiler->collect(0);
+		if (!computeBatch.empty())
+			readChunkDraws(computeBatch, computeSlots);
+	}
+
+	// Meshes generated on the host are uploaded once the whole batch is done
+	if (!cpuMeshes.empty()) {
+		for (auto &mesh : cpuMeshes)
+			if (mesh.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+				return;
+		stageCpuMeshes();
+		compute(computeSlots);
+		return;
+	}
+
+	chunkUpdate.clear();
+	glm::vec3 center = meshRenderer != nullptr ? meshRenderer->cam->pos : viewerPosition;
+	if (chunkManager.update(center, chunkUpdate)) {
+		for (auto &worldPosition : chunkUpdate.remove) {
+			releaseChunk(worldPosition);
+			pendingChunks.erase(worldPosition);
+		}
+		// Refined chunks keep drawing their old mesh until they are regenerated
+		for (auto &chunk : chunkUpdate.add)
+			if (!isUniformChunk(chunk))
+				pendingChunks.insert({ chunk.worldPosition, chunk });
+		for (auto &chunk : chunkUpdate.refine) {
+			pendingChunks.erase(chunk.worldPosition);
+			if (!isUniformChunk(chunk))
+				pendingChunks.insert({ chunk.worldPosition, chunk });
+		}
+		// Uniform chunks never hold an arena slot, so they can simply be dropped
+		chunkCache.eraseIf([this](glm::ivec3 worldPosition, const CachedChunk &chunk) {
+			return chunk.isUniform() && !chunkManager.isNearWindow(worldPosition, UNIFORM_CACHE_MARGIN);
+		});
+	}
+
+	computeBatch.clear();
+	computeSlots.clear();
+	if (!pendingChunks.empty() && !freeArenaSlots.empty()) {
+		glm::ivec3 center = chunkManager.getCenter() * (int)Chunk::CHUNK_SIZE;
+		std::vector<Chunk> candidates;
+		candidates.reserve(pendingChunks.size());
+		for (auto &entry : pendingChunks)
+			candidates.push_back(entry.second);
+
+		// Closest chunks first, anything that doesn't fit into the arena is picked up once slots are released
+		size_t batchSize = std::min<size_t>(std::min<size_t>(COMPUTE_BATCH_SIZE, freeArenaSlots.size()), candidates.size());
+		std::partial_sort(candidates.begin(), candidates.begin() + batchSize, candidates.end(), [center](const Chunk &a, const Chunk &b) {
+			glm::vec3 da = a.worldPosition - center;
+			glm::vec3 db = b.worldPosition - center;
+			return glm::dot(da, da) < glm::dot(db, db);
+		});
+
+		// The old mesh of a refined chunk stays in its slot until readChunkDraws replaces it
+		for (size_t c = 0; c < batchSize; ++c) {
+			pendingChunks.erase(candidates[c].worldPosition);
+			computeBatch.push_back(candidates[c]);
+			computeSlots.push_back(freeArenaSlots.back());
+			freeArenaSlots.pop_back();
+		}
+		updateChunkConstants(computeBatch, computeSlots);
+		if (cpuMesher != nullptr) {
+			for (auto &chunk : computeBatch)
+				cpuMeshes.push_back(cpuMesher->enqueue(chunk));
+		}
+		else
+			compute(computeSlots);
+	}
+}
+
+bool VulkanTerrain::generating() const {
+	return computeInFlight || !cpuMeshes.empty() ||
+		(!pendingChunks.empty() && (!freeArenaSlots.empty() || !retiringArenaSlots.empty()));
+}
+
+bool VulkanTerrain::drawsChunks() const {
+	return meshRenderer != nullptr && !benchmark;
+}
+
+void VulkanTerrain::releaseChunk(glm::ivec3 worldPosition) {
+	const CachedChunk *cached = chunkCache.find(worldPosition);
+	if (cached == nullptr)
+		return;
+	if (cached->arenaSlot != CachedChunk::NO_ARENA_SLOT)
+		retireArenaSlot(cached->arenaSlot);
+	// Empty and solid chunks hold no slot, keeping them saves generating them again when they come back
+	if (!cached->isUniform())
+		chunkCache.erase(worldPosition);
+}
+
+void VulkanTerrain::retireArenaSlot(uint32_t slot) {
+	if (!drawsChunks()) {
+		freeArenaSlots.push_back(slot);
+		return;
+	}
+	ChunkDrawCommand emptyDraw = ChunkDrawCommand();
+	meshRenderer->updateDraw(slot, &emptyDraw);
+	retiringArenaSlots.push_back({ meshRenderer->submittedFrames + 1, slot });
+}
+
+// Chunks that are entirely empty or solid are never meshed. They are either known from an earlier
+// generation or recognized from the bounds of the density over the chunk's heights
+bool VulkanTerrain::isUniformChunk(const Chunk &chunk) {
+	const CachedChunk *cached = chunkCache.find(chunk.worldPosition);
+	if (cached != nullptr && cached->isUniform() && cached->lod <= chunk.lod)
+		return true;
+
+	// Samples are offset like in Density.comp
+	float minY = chunk.worldPosition.y + 16.0f;
+	glm::vec2 bounds = Density::terrainBounds(minY, minY + Chunk::CHUNK_SIZE);
+	if (bounds.x <= 0.0f && bounds.y > 0.0f)
+		return false;
+
+	// The bounds hold for every level of detail
+	releaseChunk(chunk.worldPosition);
+	CachedChunk &uniform = chunkCache.insert(chunk.worldPosition);
+	uniform = CachedChunk();
+	uniform.contents = bounds.x > 0.0f ? CONTENTS_SOLID : CONTENTS_EMPTY;
+	return true;
+}
+
+void VulkanTerrain::readChunkDraws(const std::vector<Chunk> &batch, const std::vector<uint32_t> &slots) {
+	ChunkDrawCommand *draws = (ChunkDrawCommand*)drawReadBuffer.memory.mapped;
+	meshedChunks += batch.size();
+
+	for (size_t c = 0; c < batch.size(); ++c) {
+		CachedChunk &chunk = chunkCache.insert(batch[c].worldPosition);
+		uint32_t oldSlot = chunk.arenaSlot;
+		chunk.arenaSlot = slots[c];
+		chunk.lod = batch[c].lod;
+		chunk.seamFaces = batch[c].seamFaces;
+		chunk.skirtFaces = batch[c].skirtFaces;
+		chunk.contents = (ChunkContents)draws[c].contents;
+		chunk.vertexCount = std::min(draws[c].vertexCount, ARENA_SLOT_VERTICES);
+		chunk.indexCount = draws[c].draw.indexCount;
+		if (draws[c].vertexCount > ARENA_SLOT_VERTICES || draws[c].indexReserved > ARENA_SLOT_INDICES)
+			std::cout << "Chunk output exceeds its arena slot and was truncated\n";
+		// Chunks without any geometry don't need to hold on to a slot, the renderer never saw their draw.
+		// computeFence was waited for on the host, so frames submitted from now on see the whole batch
+		if (chunk.indexCount == 0) {
+			freeArenaSlots.push_back(chunk.arenaSlot);
+			chunk.arenaSlot = CachedChunk::NO_ARENA_SLOT;
+		}
+		else if (drawsChunks())
+			meshRenderer->updateDraw(chunk.arenaSlot, &draws[c]);
+		// A refined chunk swaps meshes in the same frame, its old draw is only removed together with the new one being added
+		if (oldSlot != CachedChunk::NO_ARENA_SLOT)
+			retireArenaSlot(oldSlot);
+	}
+}
+
+// Copies the finished host meshes into the staging buffer, laid out like the arena slots of the batch
+void VulkanTerrain::stageCpuMeshes() {
+	VkDeviceSize indexRegion = (VkDeviceSize)COMPUTE_BATCH_SIZE * ARENA_SLOT_VERTICES * sizeof(Vertex);
+	uint8_t *pData = (uint8_t*)cpuMeshStagingBuffer.memory.mapped;
+
+	stagedDraws.assign(cpuMeshes.size(), ChunkDrawCommand());
+	for (size_t c = 0; c < cpuMeshes.size(); ++c) {
+		ChunkMesh mesh = cpuMeshes[c].get();
+		Vertex *vertices = (Vertex*)(pData + c * ARENA_SLOT_VERTICES * sizeof(Vertex));
+		uint32_t *indices = (uint32_t*)(pData + indexRegion + c * ARENA_SLOT_INDICES * sizeof(uint32_t));
+
+		// Same truncation as BuildMesh.comp: whole triangles only, triangles using dropped vertices collapse
+		uint32_t vertexCount = std::min((uint32_t)mesh.vertices.size(), ARENA_SLOT_VERTICES);
+		uint32_t indexCount = std::min((uint32_t)mesh.indices.size(), ARENA_SLOT_INDICES / 3 * 3);
+		memcpy(vertices, mesh.vertices.data(), vertexCount * sizeof(Vertex));
+		for (uint32_t i = 0; i < indexCount; i += 3) {
+			bool dropped = std::max(std::max(mesh.indices[i], mesh.indices[i + 1]), mesh.indices[i + 2]) >= ARENA_SLOT_VERTICES;
+			for (uint32_t v = 0; v < 3; ++v)
+				indices[i + v] = dropped ? 0 : mesh.indices[i + v];
 		}
+
+		stagedDraws[c].draw.indexCount = indexCount;
+		stagedDraws[c].vertexCount = (uint32_t)mesh.vertices.size();
+		stagedDraws[c].indexReserved = (uint32_t)mesh.indices.size();
+		stagedDraws[c].contents = mesh.contents;
+	}
+	cpuMeshes.clear();
+}
+
+void VulkanTerrain::waitForCompute() {
+	if (!computeInFlight)
+		return;
+	vkTools::checkResult(vkWaitForFences(device, 1, &computeFence, VK_TRUE, UINT64_MAX));
+	vkTools::checkResult(vkResetFences(device, 1, &computeFence));
+	computeInFlight = false;
+	if (profiler != nullptr)
+		profiler->collect(0);
+}
+
+void VulkanTerrain::runBenchmark() {
+	// Chunk sets covering the surface at full and reduced resolution, empty air and solid ground.
+	// The density function has no seed, different kinds of terrain come from different regions
+	static const BenchmarkScene scenes[] = {
+		{ "surface", glm::ivec3(-4, -2, -4), glm::ivec3(4, 2, 4), 0 },
+		{ "surface-lod2", glm::ivec3(-4, -2, -4), glm::ivec3(4, 2, 4), 2 },
+		{ "air", glm::ivec3(-4, 16, -4), glm::ivec3(4, 18, 4), 0 },
+		{ "solid", glm::ivec3(-4, -18, -4), glm::ivec3(4, -16, 4), 0 }
+	};
+
+	// The host mesher is timed as the second backend, it is only created for the benchmark unless -cpumesher was given
+	std::unique_ptr<CpuMesher> referenceMesher;
+	CpuMesher *hostMesher = cpuMesher;
+	if (hostMesher == nullptr) {
+		referenceMesher.reset(new CpuMesher());
+		hostMesher = referenceMesher.get();
 	}
-	for (Chunk c : chunks) {
-		// TODO: run compute shader here
-		updateUniformBuffers(c);
-		compute();
-		readStorageBuffers(vertexBuffer, indexBuffer);
+	CpuMesher *backends[2] = { nullptr, hostMesher };
+	const char *backendNames[2] = { "gpu", "cpu" };
+
+	for (uint32_t b = 0; b < 2; ++b) {
+		cpuMesher = backends[b];
+		for (auto &scene : scenes) {
+			BenchmarkResult result;
+			result.backend = backendNames[b];
+			result.scene = scene.name;
+			benchmarkScene(scene, result);
+			result.write(std::cout, deviceProperties.deviceName);
+		}
 	}
 
-	createBuffer(
-		VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
-		vertexBuffer.size() * sizeof(Vertex),
-		vertexBuffer.data(),
-		&meshRenderer->meshes.terrain.vertices.buf,
-		&meshRenderer->meshes.terrain.vertices.mem);
+	// Both backends have to produce the same meshes
+	cpuMesher = nullptr;
+	for (auto &scene : scenes) {
+		MesherCheck check;
+		checkMeshers(scene, check);
+		check.write(std::cout, deviceProperties.deviceName);
+	}
+	if (profiler != nullptr)
+		profiler->report(std::cout);
+	std::cout.flush();
+	cpuMesher = referenceMesher ? nullptr : hostMesher;
+}
 
-	createBuffer(
-		VK_BUFFER_USAGE_INDEX_BUFFER_BIT,
-		indexBuffer.size() * sizeof(uint32_t),
-		indexBuffer.data(),
-		&meshRenderer->meshes.terrain.indices.buf,
-		&meshRenderer->meshes.terrain.indices.mem);
+void VulkanTerrain::benchmarkScene(const BenchmarkScene &scene, BenchmarkResult &result) {
+	std::vector<Chunk> chunks;
+	for (int z = scene.min.z; z < scene.max.z; ++z)
+		for (int y = scene.min.y; y < scene.max.y; ++y)
+			for (int x = scene.min.x; x < scene.max.x; ++x) {
+				Chunk chunk(glm::ivec3(x, y, z) * (int)Chunk::CHUNK_SIZE);
+				chunk.lod = scene.lod;
+				chunks.push_back(chunk);
+			}
+	uint64_t cellsPerAxis = Chunk::CHUNK_SIZE >> scene.lod;
+
+	// Batches are generated one after another and released again right away, so scenes can exceed the arena
+	auto tStart = std::chrono::high_resolution_clock::now();
+	for (size_t first = 0; first < chunks.size(); first += COMPUTE_BATCH_SIZE) {
+		computeBatch.assign(chunks.begin() + first, chunks.begin() + std::min<size_t>(first + COMPUTE_BATCH_SIZE, chunks.size()));
+		computeSlots.clear();
+		for (size_t c = 0; c < computeBatch.size(); ++c) {
+			computeSlots.push_back(freeArenaSlots.back());
+			freeArenaSlots.pop_back();
+		}
 
-	meshRenderer->meshes.terrain.indexCount = indexBuffer.size();
+		StageTimer timer;
+		updateChunkConstants(computeBatch, computeSlots);
+		timer.lap(result.stageMs[BenchmarkResult::Uniform]);
+
+		if (cpuMesher != nullptr) {
+			for (auto &chunk : computeBatch)
+				cpuMeshes.push_back(cpuMesher->enqueue(chunk));
+			for (auto &mesh : cpuMeshes)
+				mesh.wait();
+			timer.lap(result.stageMs[BenchmarkResult::Dispatch]);
+
+			stageCpuMeshes();
+			timer.lap(result.stageMs[BenchmarkResult::Append]);
+
+			compute(computeSlots);
+			waitForCompute();
+			timer.lap(result.stageMs[BenchmarkResult::Upload]);
+			for (auto &draw : stagedDraws)
+				result.bytesUploaded += std::min(draw.vertexCount, ARENA_SLOT_VERTICES) * sizeof(Vertex) + draw.draw.indexCount * sizeof(uint32_t);
+		}
+		else {
+			compute(computeSlots);
+			waitForCompute();
+			timer.lap(result.stageMs[BenchmarkResult::Dispatch]);
+		}
 
-	vertexBuffer.clear();
-	indexBuffer.clear();
+		readChunkDraws(computeBatch, computeSlots);
+		timer.lap(result.stageMs[BenchmarkResult::Readback]);
+		result.bytesReadBack += computeSlots.size() * sizeof(ChunkDrawCommand);
+
+		for (auto &chunk : computeBatch) {
+			result.triangles += chunkCache.find(chunk.worldPosition)->indexCount / 3;
+			releaseChunk(chunk.worldPosition);
+		}
+	}
+	auto tEnd = std::chrono::high_resolution_clock::now();
+
+	result.chunks = chunks.size();
+	result.voxels = chunks.size() * cellsPerAxis * cellsPerAxis * cellsPerAxis;
+	result.totalMs = std::chrono::duration<double, std::milli>(tEnd - tStart).count();
+}
+
+// Vertices of a without a vertex of b at the same position and with the same normal, and the other way around
+static uint64_t unmatchedVertices(const std::vector<Vertex> &a, std::vector<Vertex> b, float tolerance) {
+	std::sort(b.begin(), b.end(), [](const Vertex &u, const Vertex &v) { return u.pos[0] < v.pos[0]; });
+	std::vector<bool> used(b.size());
+	uint64_t matched = 0;
+	for (auto &vertex : a) {
+		auto candidate = std::lower_bound(b.begin(), b.end(), vertex.pos[0] - tolerance, [](const Vertex &v, float x) { return v.pos[0] < x; });
+		for (; candidate != b.end() && candidate->pos[0] <= vertex.pos[0] + tolerance; ++candidate) {
+			size_t index = candidate - b.begin();
+			bool same = !used[index];
+			for (int k = 0; k < 3 && same; ++k)
+				same = fabsf(candidate->pos[k] - vertex.pos[k]) <= tolerance && fabsf(candidate->norm[k] - vertex.norm[k]) <= tolerance;
+			if (same) {
+				used[index] = true;
+				matched++;
+				break;
+			}
+		}
+	}
+	return a.size() + b.size() - 2 * matched;
+}
+
+void VulkanTerrain::checkMeshers(const BenchmarkScene &scene, MesherCheck &check) {
+	Chunk chunk((scene.min + (scene.max - scene.min) / 2) * (int)Chunk::CHUNK_SIZE);
+	chunk.lod = scene.lod;
+	check.scene = scene.name;
+	check.chunk = chunk.worldPosition;
+
+	ChunkMesh reference;
+	CpuMesher::generate(chunk, reference);
+	check.cpuVertices = reference.vertices.size();
+	check.cpuTriangles = reference.indices.size() / 3;
+
+	computeBatch.assign(1, chunk);
+	computeSlots.assign(1, freeArenaSlots.back());
+	freeArenaSlots.pop_back();
+	updateChunkConstants(computeBatch, computeSlots);
+	compute(computeSlots);
+	waitForCompute();
+	readChunkDraws(computeBatch, computeSlots);
+
+	// Chunks without triangles have already given their slot back
+	ChunkMesh generated;
+	const CachedChunk *cached = chunkCache.find(chunk.worldPosition);
+	if (cached->arenaSlot != CachedChunk::NO_ARENA_SLOT)
+		readArenaSlot(cached->arenaSlot, cached->vertexCount, cached->indexCount, generated);
+	check.gpuVertices = generated.vertices.size();
+	check.gpuTriangles = generated.indices.size() / 3;
+	// Densities of the two only differ by float rounding, which moves vertices by far less than this
+	check.unmatchedVertices = unmatchedVertices(generated.vertices, reference.vertices, 0.01f);
+	releaseChunk(chunk.worldPosition);
 }
 
-void VulkanTerrain::buildComputeCommandBuffer() {
+void VulkanTerrain::readArenaSlot(uint32_t slot, uint32_t vertexCount, uint32_t indexCount, ChunkMesh &mesh) {
+	VkDeviceSize indexRegion = (VkDeviceSize)COMPUTE_BATCH_SIZE * ARENA_SLOT_VERTICES * sizeof(Vertex);
+	VkCommandBufferBeginInfo cmdBufInfo = vkTools::initializers::commandBufferBeginInfo();
+	vkTools::checkResult(vkBeginCommandBuffer(computeCmdBuffer, &cmdBufInfo));
+
+	VkMemoryBarrier meshBarrier = vkTools::initializers::memoryBarrier();
+	meshBarrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT | VK_ACCESS_TRANSFER_WRITE_BIT;
+	meshBarrier.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+	vkCmdPipelineBarrier(
+		computeCmdBuffer,
+		VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_TRANSFER_BIT,
+		VK_PIPELINE_STAGE_TRANSFER_BIT,
+		VK_FLAGS_NONE,
+		1, &meshBarrier,
+		0, nullptr,
+		0, nullptr);
+
+	VkBufferCopy vertexCopy = { (VkDeviceSize)slot * ARENA_SLOT_VERTICES * sizeof(Vertex), 0, vertexCount * sizeof(Vertex) };
+	VkBufferCopy indexCopy = { (VkDeviceSize)slot * ARENA_SLOT_INDICES * sizeof(uint32_t), indexRegion, indexCount * sizeof(uint32_t) };
+	if (vertexCount > 0)
+		vkCmdCopyBuffer(computeCmdBuffer, storageBuffers.vertex_buffer.buffer, cpuMeshStagingBuffer.buffer, 1, &vertexCopy);
+	if (indexCount > 0)
+		vkCmdCopyBuffer(computeCmdBuffer, storageBuffers.index_buffer.buffer, cpuMeshStagingBuffer.buffer, 1, &indexCopy);
+
+	VkMemoryBarrier hostBarrier = vkTools::initializers::memoryBarrier();
+	hostBarrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+	hostBarrier.dstAccessMask = VK_ACCESS_HOST_READ_BIT;
+	vkCmdPipelineBarrier(
+		computeCmdBuffer,
+		VK_PIPELINE_STAGE_TRANSFER_BIT,
+		VK_PIPELINE_STAGE_HOST_BIT,
+		VK_FLAGS_NONE,
+		1, &hostBarrier,
+		0, nullptr,
+		0, nullptr);
+	vkTools::checkResult(vkEndCommandBuffer(computeCmdBuffer));
+
+	VkSubmitInfo submitInfo = vkTools::initializers::submitInfo();
+	submitInfo.commandBufferCount = 1;
+	submitInfo.pCommandBuffers = &computeCmdBuffer;
+	vkTools::checkResult(vkQueueSubmit(computeQueue, 1, &submitInfo, computeFence));
+	vkTools::checkResult(vkWaitForFences(device, 1, &computeFence, VK_TRUE, UINT64_MAX));
+	vkTools::checkResult(vkResetFences(device, 1, &computeFence));
+
+	uint8_t *pData = (uint8_t*)cpuMeshStagingBuffer.memory.mapped;
+	mesh.vertices.assign((Vertex*)pData, (Vertex*)pData + vertexCount);
+	mesh.indices.assign((uint32_t*)(pData + indexRegion), (uint32_t*)(pData + indexRegion) + indexCount);
+}
+
+void VulkanTerrain::buildComputeCommandBuffer(const std::vector<uint32_t> &slots) {
 	// Only need to define one command buffer for compute pass, 
 	// as there are no framebuffers
 	VkCommandBufferBeginInfo cmdBufInfo = vkTools::initializers::commandBufferBeginInfo();
 
 	vkBeginCommandBuffer(computeCmdBuffer, &cmdBufInfo);
+	if (profiler != nullptr)
+		profiler->reset(computeCmdBuffer, 0);
+
+	// Point the draws of the batch at their slots, the shader allocates its output from the counts atomically.
+	// Host meshes are staged with their final counts
+	for (size_t c = 0; c < slots.size(); ++c) {
+		uint32_t slot = slots[c];
+		ChunkDrawCommand drawCommand = (cpuMesher != nullptr) ? stagedDraws[c] : ChunkDrawCommand();
+		drawCommand.draw.instanceCount = 1;
+		drawCommand.draw.firstIndex = slot * ARENA_SLOT_INDICES;
+		drawCommand.draw.vertexOffset = slot * ARENA_SLOT_VERTICES;
+		// Skirt vertices lie up to two cells of the chunk's stride below the surface, see writeVertex
+		int skirtReach = chunkConstants[c].lod.w != 0 ? 2 << chunkConstants[c].lod.x : 0;
+		drawCommand.chunkPosition = glm::ivec4(glm::ivec3(chunkConstants[c].position), skirtReach);
+		vkCmdUpdateBuffer(computeCmdBuffer, storageBuffers.draw_buffer.buffer, slot * sizeof(ChunkDrawCommand), sizeof(ChunkDrawCommand), (uint32_t*)&drawCommand);
+	}
 
-	vkCmdBindPipeline(computeCmdBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, pipelines.compute);
-	vkCmdBindDescriptorSets(computeCmdBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, computePipelineLayout, 0, 1, &computeDescriptorSet, 0, 0);
+	VkMemoryBarrier fillBarrier = vkTools::initializers::memoryBarrier();
+	fillBarrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+	fillBarrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+	vkCmdPipelineBarrier(
+		computeCmdBuffer,
+		VK_PIPELINE_STAGE_TRANSFER_BIT,
+		VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+		VK_FLAGS_NONE,
+		1, &fillBarrier,
+		0, nullptr,
+		0, nullptr);
+
+	if (profiler != nullptr && !slots.empty())
+		profiler->begin(computeCmdBuffer, 0, PROFILE_MESH);
+	if (!slots.empty() && cpuMesher != nullptr) {
+		VkDeviceSize indexRegion = (VkDeviceSize)COMPUTE_BATCH_SIZE * ARENA_SLOT_VERTICES * sizeof(Vertex);
+		std::vector<VkBufferCopy> vertexCopies;
+		std::vector<VkBufferCopy> indexCopies;
+		for (size_t c = 0; c < slots.size(); ++c) {
+			uint32_t vertexCount = std::min(stagedDraws[c].vertexCount, ARENA_SLOT_VERTICES);
+			if (vertexCount > 0)
+				vertexCopies.push_back({ c * ARENA_SLOT_VERTICES * sizeof(Vertex), (VkDeviceSize)slots[c] * ARENA_SLOT_VERTICES * sizeof(Vertex), vertexCount * sizeof(Vertex) });
+			if (stagedDraws[c].draw.indexCount > 0)
+				indexCopies.push_back({ indexRegion + c * ARENA_SLOT_INDICES * sizeof(uint32_t), (VkDeviceSize)slots[c] * ARENA_SLOT_INDICES * sizeof(uint32_t), stagedDraws[c].draw.indexCount * sizeof(uint32_t) });
+		}
+		if (!vertexCopies.empty())
+			vkCmdCopyBuffer(computeCmdBuffer, cpuMeshStagingBuffer.buffer, storageBuffers.vertex_buffer.buffer, vertexCopies.size(), vertexCopies.data());
+		if (!indexCopies.empty())
+			vkCmdCopyBuffer(computeCmdBuffer, cpuMeshStagingBuffer.buffer, storageBuffers.index_buffer.buffer, indexCopies.size(), indexCopies.data());
+	}
+	else if (!slots.empty()) {
+		vkCmdBindDescriptorSets(computeCmdBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, computePipelineLayout, 0, 1, &computeDescriptorSet, 0, 0);
+
+		// Every chunk is a dispatch of its own with its constants pushed right before it.
+		// Densities are only evaluated for chunks without a cached brick
+		vkCmdBindPipeline(computeCmdBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, pipelines.density);
+		glm::uvec3 densityGroupCount = (glm::uvec3(DENSITY_BRICK_SIZE) + meshWorkgroupSize - 1u) / meshWorkgroupSize;
+		for (size_t c = 0; c < slots.size(); ++c) {
+			if (chunkConstants[c].brick.w == 0)
+				continue;
+			vkCmdPushConstants(computeCmdBuffer, computePipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(ChunkConstants), &chunkConstants[c]);
+			vkCmdDispatch(computeCmdBuffer, densityGroupCount.x, densityGroupCount.y, densityGroupCount.z);
+		}
+
+		// Also makes bricks written by earlier batches visible
+		VkMemoryBarrier densityBarrier = vkTools::initializers::memoryBarrier();
+		densityBarrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+		densityBarrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+		vkCmdPipelineBarrier(
+			computeCmdBuffer,
+			VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+			VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+			VK_FLAGS_NONE,
+			1, &densityBarrier,
+			0, nullptr,
+			0, nullptr);
+
+		// Vertices are placed on the samples of each chunk, then the cells are connected with indices
+		vkCmdBindPipeline(computeCmdBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, pipelines.vertices);
+		glm::uvec3 vertexGroupCount = (glm::uvec3(Chunk::CHUNK_SIZE + 1) + meshWorkgroupSize - 1u) / meshWorkgroupSize;
+		for (size_t c = 0; c < slots.size(); ++c) {
+			vkCmdPushConstants(computeCmdBuffer, computePipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(ChunkConstants), &chunkConstants[c]);
+			vkCmdDispatch(computeCmdBuffer, vertexGroupCount.x, vertexGroupCount.y, vertexGroupCount.z);
+		}
 
-	vkCmdDispatch(computeCmdBuffer, Chunk::CHUNK_SIZE, Chunk::CHUNK_SIZE, Chunk::CHUNK_SIZE);
+		VkMemoryBarrier vertexBarrier = vkTools::initializers::memoryBarrier();
+		vertexBarrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+		vertexBarrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+		vkCmdPipelineBarrier(
+			computeCmdBuffer,
+			VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+			VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+			VK_FLAGS_NONE,
+			1, &vertexBarrier,
+			0, nullptr,
+			0, nullptr);
+
+		vkCmdBindPipeline(computeCmdBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, pipelines.compute);
+		glm::uvec3 meshGroupCount = (glm::uvec3(Chunk::CHUNK_SIZE) + meshWorkgroupSize - 1u) / meshWorkgroupSize;
+		for (size_t c = 0; c < slots.size(); ++c) {
+			vkCmdPushConstants(computeCmdBuffer, computePipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(ChunkConstants), &chunkConstants[c]);
+			vkCmdDispatch(computeCmdBuffer, meshGroupCount.x, meshGroupCount.y, meshGroupCount.z);
+		}
+	}
+	if (profiler != nullptr && !slots.empty())
+		profiler->end(computeCmdBuffer, 0, PROFILE_MESH);
+
+	// The draws of the batch go back to the host, which hands them to the renderer, see readChunkDraws
+	VkMemoryBarrier dispatchBarrier = vkTools::initializers::memoryBarrier();
+	dispatchBarrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT | VK_ACCESS_TRANSFER_WRITE_BIT;
+	dispatchBarrier.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+	vkCmdPipelineBarrier(
+		computeCmdBuffer,
+		VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_TRANSFER_BIT,
+		VK_PIPELINE_STAGE_TRANSFER_BIT,
+		VK_FLAGS_NONE,
+		1, &dispatchBarrier,
+		0, nullptr,
+		0, nullptr);
+
+	if (!slots.empty()) {
+		std::vector<VkBufferCopy> drawCopies(slots.size());
+		for (size_t c = 0; c < slots.size(); ++c) {
+			drawCopies[c].srcOffset = slots[c] * sizeof(ChunkDrawCommand);
+			drawCopies[c].dstOffset = c * sizeof(ChunkDrawCommand);
+			drawCopies[c].size = sizeof(ChunkDrawCommand);
+		}
+		if (profiler != nullptr)
+			profiler->begin(computeCmdBuffer, 0, PROFILE_READBACK);
+		vkCmdCopyBuffer(computeCmdBuffer, storageBuffers.draw_buffer.buffer, drawReadBuffer.buffer, drawCopies.size(), drawCopies.data());
+		if (profiler != nullptr)
+			profiler->end(computeCmdBuffer, 0, PROFILE_READBACK);
+	}
 
 	vkEndCommandBuffer(computeCmdBuffer);
 }
@@ -68,137 +587,141 @@ void VulkanTerrain::draw() {
 	computeSubmitInfo.commandBufferCount = 1;
 	computeSubmitInfo.pCommandBuffers = &computeCmdBuffer;
 
-	vkTools::checkResult(vkQueueSubmit(queue, 1, &computeSubmitInfo, VK_NULL_HANDLE));
-
-	vkTools::checkResult(vkQueueWaitIdle(queue));
+	// Signalled once the whole batch has been written to the arena, polled by loadMesh
+	vkTools::checkResult(vkQueueSubmit(computeQueue, 1, &computeSubmitInfo, computeFence));
+	computeInFlight = true;
 }
 
 void VulkanTerrain::prepareStorageBuffers() {
-	uint32_t vertexBufferMaxSize = 32*32*32*3 * sizeof(Vertex);
-	uint32_t indexBufferMaxSize = 32*32*32*5*3 * sizeof(uint32_t);
-	VkMemoryAllocateInfo memAlloc = vkTools::initializers::memoryAllocateInfo();
-	VkMemoryRequirements memReqs;
+	// The storage buffers are the mesh arena: the compute shader writes each chunk
+	// into its own slot and the terrain is drawn straight from them
+	VkDeviceSize vertexBufferSize = (VkDeviceSize)ARENA_SLOT_COUNT * ARENA_SLOT_VERTICES * sizeof(Vertex);
+	VkDeviceSize indexBufferSize = (VkDeviceSize)ARENA_SLOT_COUNT * ARENA_SLOT_INDICES * sizeof(uint32_t);
 
 	VkBufferCreateInfo vBufferInfo =
 		vkTools::initializers::bufferCreateInfo(
-			VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
-			vertexBufferMaxSize);
+			VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+			vertexBufferSize);
 	VkBufferCreateInfo iBufferInfo =
 		vkTools::initializers::bufferCreateInfo(
-			VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
-			indexBufferMaxSize);
+			VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_INDEX_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+			indexBufferSize);
+
+	// Written on the compute queue and read on the graphics queue, which may be different families
+	uint32_t sharedQueueFamilies[2] = { queueFamilyIndices.graphics, queueFamilyIndices.compute };
+	if (queueFamilyIndices.graphics != queueFamilyIndices.compute) {
+		vBufferInfo.sharingMode = VK_SHARING_MODE_CONCURRENT;
+		vBufferInfo.queueFamilyIndexCount = 2;
+		vBufferInfo.pQueueFamilyIndices = sharedQueueFamilies;
+		iBufferInfo.sharingMode = VK_SHARING_MODE_CONCURRENT;
+		iBufferInfo.queueFamilyIndexCount = 2;
+		iBufferInfo.pQueueFamilyIndices = sharedQueueFamilies;
+	}
 
 	// Create a buffer on the GPU to hold the data
 	vkTools::checkResult(vkCreateBuffer(device, &vBufferInfo, nullptr, &storageBuffers.vertex_buffer.buffer));
-	// Get the memory needed by this buffer
-	vkGetBufferMemoryRequirements(device, storageBuffers.vertex_buffer.buffer, &memReqs);
-	memAlloc.allocationSize = memReqs.size;
-	getMemoryType(memReqs.memoryTypeBits, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &memAlloc.memoryTypeIndex);
-	// Allocate space for buffer on GPU and store the address in stagingBuffer.memory
-	vkTools::checkResult(vkAllocateMemory(device, &memAlloc, nullptr, &storageBuffers.vertex_buffer.memory));
-	// Bind the buffer
-	vkTools::checkResult(vkBindBufferMemory(device, storageBuffers.vertex_buffer.buffer, storageBuffers.vertex_buffer.memory, 0));
+	// Allocate and bind memory on the GPU
+	storageBuffers.vertex_buffer.memory = allocator->allocateBuffer(storageBuffers.vertex_buffer.buffer, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+	storageBuffers.vertex_buffer.descriptor = { storageBuffers.vertex_buffer.buffer, 0, vertexBufferSize };
 
 	// Repeat for index buffer
 	vkTools::checkResult(vkCreateBuffer(device, &iBufferInfo, nullptr, &storageBuffers.index_buffer.buffer));
-	vkGetBufferMemoryRequirements(device, storageBuffers.index_buffer.buffer, &memReqs);
-	memAlloc.allocationSize = memReqs.size;
-	getMemoryType(memReqs.memoryTypeBits, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &memAlloc.memoryTypeIndex);
-	vkTools::checkResult(vkAllocateMemory(device, &memAlloc, nullptr, &storageBuffers.index_buffer.memory));
-	vkTools::checkResult(vkBindBufferMemory(device, storageBuffers.index_buffer.buffer, storageBuffers.index_buffer.memory, 0));
-}
-
-void VulkanTerrain::readStorageBuffers(std::vector<Vertex> & vertexBuffer_complete, std::vector<uint32_t> & indexBuffer_complete) {
-	std::vector<Vertex> vertexBuffer;
-	std::vector<uint32_t> indexBuffer;
-	uint32_t vertexBufferMaxSize = 32 * 32 * 32 * 3 * sizeof(Vertex);
-	uint32_t indexBufferMaxSize = 32 * 32 * 32 * 5 * 3 * sizeof(uint32_t);
-	VkMemoryAllocateInfo memAlloc = vkTools::initializers::memoryAllocateInfo();
-	VkMemoryRequirements memReqs;
-
-	void *data;
-
-	struct StagingBuffer {
-		VkDeviceMemory memory;
-		VkBuffer buffer;
-	} vertexReadBuffer, indexReadBuffer;
+	storageBuffers.index_buffer.memory = allocator->allocateBuffer(storageBuffers.index_buffer.buffer, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+	storageBuffers.index_buffer.descriptor = { storageBuffers.index_buffer.buffer, 0, indexBufferSize };
 
-	VkBufferCreateInfo vBufferInfo =
-		vkTools::initializers::bufferCreateInfo(
-			VK_BUFFER_USAGE_TRANSFER_DST_BIT,
-			vertexBufferMaxSize);
-	VkBufferCreateInfo iBufferInfo =
+	// Indirect draw per slot, the mesher fills in the counts. Only used by the compute queue, every entry of
+	// a batch is written before it is read. The renderer keeps its own table, see Mesh::updateDraw
+	VkDeviceSize drawBufferSize = ARENA_SLOT_COUNT * sizeof(ChunkDrawCommand);
+	VkBufferCreateInfo dBufferInfo =
 		vkTools::initializers::bufferCreateInfo(
-			VK_BUFFER_USAGE_TRANSFER_DST_BIT,
-			indexBufferMaxSize);
-
-	// Create local buffers to copy data from the GPU into
-	vkTools::checkResult(vkCreateBuffer(device, &vBufferInfo, nullptr, &vertexReadBuffer.buffer));
-	vkGetBufferMemoryRequirements(device, vertexReadBuffer.buffer, &memReqs);
-	memAlloc.allocationSize = memReqs.size;
-	getMemoryType(memReqs.memoryTypeBits, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT, &memAlloc.memoryTypeIndex);
-	vkTools::checkResult(vkAllocateMemory(device, &memAlloc, nullptr, &vertexReadBuffer.memory));
-	vkTools::checkResult(vkBindBufferMemory(device, vertexReadBuffer.buffer, vertexReadBuffer.memory, 0));
-
-	vkTools::checkResult(vkCreateBuffer(device, &iBufferInfo, nullptr, &indexReadBuffer.buffer));
-	vkGetBufferMemoryRequirements(device, indexReadBuffer.buffer, &memReqs);
-	memAlloc.allocationSize = memReqs.size;
-	getMemoryType(memReqs.memoryTypeBits, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT, &memAlloc.memoryTypeIndex);
-	vkTools::checkResult(vkAllocateMemory(device, &memAlloc, nullptr, &indexReadBuffer.memory));
-	vkTools::checkResult(vkBindBufferMemory(device, indexReadBuffer.buffer, indexReadBuffer.memory, 0));
-
-	createSetupCommandBuffer();
-
-	VkBufferCopy copyRegion = {};
-	copyRegion.size = vertexBufferMaxSize;
-	vkCmdCopyBuffer(
-		setupCmdBuffer,
-		storageBuffers.vertex_buffer.buffer,
-		vertexReadBuffer.buffer,
-		1,
-		&copyRegion);
+			VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+			drawBufferSize);
+	vkTools::checkResult(vkCreateBuffer(device, &dBufferInfo, nullptr, &storageBuffers.draw_buffer.buffer));
+	storageBuffers.draw_buffer.memory = allocator->allocateBuffer(storageBuffers.draw_buffer.buffer, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+	storageBuffers.draw_buffer.descriptor = { storageBuffers.draw_buffer.buffer, 0, drawBufferSize };
+
+	// Only read and written by the compute queue, every edge that is read was written by the same batch
+	VkDeviceSize edgeGridSize = Chunk::CHUNK_SIZE + 1;
+	// Three edges per sample, each followed by the skirt vertex below it
+	VkDeviceSize edgeBufferSize = COMPUTE_BATCH_SIZE * edgeGridSize * edgeGridSize * edgeGridSize * 6 * sizeof(uint32_t);
+	VkBufferCreateInfo eBufferInfo = vkTools::initializers::bufferCreateInfo(VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, edgeBufferSize);
+	vkTools::checkResult(vkCreateBuffer(device, &eBufferInfo, nullptr, &storageBuffers.edge_buffer.buffer));
+	storageBuffers.edge_buffer.memory = allocator->allocateBuffer(storageBuffers.edge_buffer.buffer, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+	storageBuffers.edge_buffer.descriptor = { storageBuffers.edge_buffer.buffer, 0, edgeBufferSize };
+
+	// Host visible copy of the draws of the current batch
+	dBufferInfo.usage = VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+	dBufferInfo.size = COMPUTE_BATCH_SIZE * sizeof(ChunkDrawCommand);
+	vkTools::checkResult(vkCreateBuffer(device, &dBufferInfo, nullptr, &drawReadBuffer.buffer));
+	drawReadBuffer.memory = allocator->allocateBuffer(drawReadBuffer.buffer, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+
+	// One batch of host meshes, see stageCpuMeshes. The benchmark also reads arena slots back through it
+	if (cpuMesher != nullptr || benchmark)
+		createBuffer(
+			VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+			(VkDeviceSize)COMPUTE_BATCH_SIZE * (ARENA_SLOT_VERTICES * sizeof(Vertex) + ARENA_SLOT_INDICES * sizeof(uint32_t)),
+			nullptr,
+			&cpuMeshStagingBuffer.buffer,
+			&cpuMeshStagingBuffer.memory);
+
+	freeArenaSlots.clear();
+	for (uint32_t slot = ARENA_SLOT_COUNT; slot > 0; --slot)
+		freeArenaSlots.push_back(slot - 1);
+
+	if (meshRenderer == nullptr)
+		return;
+	meshRenderer->meshes.terrain.vertices.buf = storageBuffers.vertex_buffer.buffer;
+	meshRenderer->meshes.terrain.indices.buf = storageBuffers.index_buffer.buffer;
+	meshRenderer->meshes.terrain.drawCount = ARENA_SLOT_COUNT;
+	meshRenderer->meshes.terrain.drawStride = sizeof(ChunkDrawCommand);
+}
 
-	copyRegion.size = indexBufferMaxSize;
-	vkCmdCopyBuffer(
+void VulkanTerrain::prepareDensityAtlas() {
+	// Bricks are laid out in a box that stays within the maximum extent of 3D images
+	uint32_t bricksPerAxis = deviceProperties.limits.maxImageDimension3D / DENSITY_BRICK_SIZE;
+	uint32_t brickCount = std::min(DENSITY_BRICK_COUNT, bricksPerAxis * bricksPerAxis * bricksPerAxis);
+	densityAtlas.bricks.x = std::min(bricksPerAxis, brickCount);
+	densityAtlas.bricks.y = std::min(bricksPerAxis, (brickCount + densityAtlas.bricks.x - 1) / densityAtlas.bricks.x);
+	densityAtlas.bricks.z = (brickCount + densityAtlas.bricks.x * densityAtlas.bricks.y - 1) / (densityAtlas.bricks.x * densityAtlas.bricks.y);
+	densityCache.reset(brickCount);
+
+	VkImageCreateInfo imageCreateInfo = vkTools::initializers::imageCreateInfo();
+	imageCreateInfo.imageType = VK_IMAGE_TYPE_3D;
+	imageCreateInfo.format = VK_FORMAT_R32_SFLOAT;
+	imageCreateInfo.extent = { densityAtlas.bricks.x * DENSITY_BRICK_SIZE, densityAtlas.bricks.y * DENSITY_BRICK_SIZE, densityAtlas.bricks.z * DENSITY_BRICK_SIZE };
+	imageCreateInfo.mipLevels = 1;
+	imageCreateInfo.arrayLayers = 1;
+	imageCreateInfo.samples = VK_SAMPLE_COUNT_1_BIT;
+	imageCreateInfo.tiling = VK_IMAGE_TILING_OPTIMAL;
+	imageCreateInfo.usage = VK_IMAGE_USAGE_STORAGE_BIT;
+	imageCreateInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+	vkTools::checkResult(vkCreateImage(device, &imageCreateInfo, nullptr, &densityAtlas.image));
+
+	densityAtlas.mem = allocator->allocateImage(densityAtlas.image, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+
+	// The atlas is only accessed by compute and stays in the general layout
+	vkTools::setImageLayout(
 		setupCmdBuffer,
-		storageBuffers.index_buffer.buffer,
-		indexReadBuffer.buffer,
-		1,
-		&copyRegion);
-
-	flushSetupCommandBuffer();
-
-	// Copy data from the GPU buffer to local vectors
-	vkTools::checkResult(vkMapMemory(device, vertexReadBuffer.memory, 0, vertexBufferMaxSize, 0, &data));
-	vertexBuffer.resize(vertexBufferMaxSize);
-	memcpy(&vertexBuffer[0], data, vertexBufferMaxSize);
-	vkUnmapMemory(device, vertexReadBuffer.memory);
-
-	vkTools::checkResult(vkMapMemory(device, indexReadBuffer.memory, 0, indexBufferMaxSize, 0, &data));
-	vertexBuffer.resize(indexBufferMaxSize);
-	memcpy(&vertexBuffer[0], data, indexBufferMaxSize);
-	vkUnmapMemory(device, indexReadBuffer.memory);
-
-	for (auto v : vertexBuffer) {
-		if (&v != nullptr)
-			vertexBuffer_complete.push_back(v);
-	}
-	for (auto i : indexBuffer) {
-		if (&i != nullptr)
-			indexBuffer_complete.push_back(i + vertexBuffer_complete.size());
-	}
-
-	// Cleanup buffers
-	vkDestroyBuffer(device, vertexReadBuffer.buffer, nullptr);
-	vkFreeMemory(device, vertexReadBuffer.memory, nullptr);
-	vkDestroyBuffer(device, indexReadBuffer.buffer, nullptr);
-	vkFreeMemory(device, indexReadBuffer.memory, nullptr);
+		densityAtlas.image,
+		VK_IMAGE_ASPECT_COLOR_BIT,
+		VK_IMAGE_LAYOUT_UNDEFINED,
+		VK_IMAGE_LAYOUT_GENERAL);
+
+	VkImageViewCreateInfo viewCreateInfo = vkTools::initializers::imageViewCreateInfo();
+	viewCreateInfo.viewType = VK_IMAGE_VIEW_TYPE_3D;
+	viewCreateInfo.format = VK_FORMAT_R32_SFLOAT;
+	viewCreateInfo.components = { VK_COMPONENT_SWIZZLE_R, VK_COMPONENT_SWIZZLE_G, VK_COMPONENT_SWIZZLE_B, VK_COMPONENT_SWIZZLE_A };
+	viewCreateInfo.subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 };
+	viewCreateInfo.image = densityAtlas.image;
+	vkTools::checkResult(vkCreateImageView(device, &viewCreateInfo, nullptr, &densityAtlas.view));
+
+	densityAtlas.descriptor = vkTools::initializers::descriptorImageInfo(VK_NULL_HANDLE, densityAtlas.view, VK_IMAGE_LAYOUT_GENERAL);
 }
 
 void VulkanTerrain::setupDescriptorPool() {
 	std::vector<VkDescriptorPoolSize> poolSizes = {
-		vkTools::initializers::descriptorPoolSize(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, 2),
-		vkTools::initializers::descriptorPoolSize(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 2)
+		vkTools::initializers::descriptorPoolSize(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 5),
+		vkTools::initializers::descriptorPoolSize(VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, 1)
 	};
 
 	VkDescriptorPoolCreateInfo descriptorPoolInfo =
@@ -213,21 +736,29 @@ void VulkanTerrain::setupDescriptorPool() {
 void VulkanTerrain::setupDescriptorSetLayout() {
 	std::vector<VkDescriptorSetLayoutBinding> setLayoutBindings = {
 		vkTools::initializers::descriptorSetLayoutBinding(
-			VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER,
-			VK_SHADER_STAGE_COMPUTE_BIT,
-			0),
-		vkTools::initializers::descriptorSetLayoutBinding(
-			VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER,
+			VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
 			VK_SHADER_STAGE_COMPUTE_BIT,
 			1),
 		vkTools::initializers::descriptorSetLayoutBinding(
-			VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC,
+			VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
 			VK_SHADER_STAGE_COMPUTE_BIT,
 			2),
 		vkTools::initializers::descriptorSetLayoutBinding(
-			VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC,
+			VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+			VK_SHADER_STAGE_COMPUTE_BIT,
+			3),
+		vkTools::initializers::descriptorSetLayoutBinding(
+			VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+			VK_SHADER_STAGE_COMPUTE_BIT,
+			4),
+		vkTools::initializers::descriptorSetLayoutBinding(
+			VK_DESCRIPTOR_TYPE_STORAGE_IMAGE,
 			VK_SHADER_STAGE_COMPUTE_BIT,
-			3)
+			5),
+		vkTools::initializers::descriptorSetLayoutBinding(
+			VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+			VK_SHADER_STAGE_COMPUTE_BIT,
+			6)
 	};
 
 	VkDescriptorSetLayoutCreateInfo descriptorLayout =
@@ -242,6 +773,10 @@ void VulkanTerrain::setupDescriptorSetLayout() {
 			&computeDescriptorSetLayout,
 			1);
 
+	VkPushConstantRange pushConstantRange = vkTools::initializers::pushConstantRange(VK_SHADER_STAGE_COMPUTE_BIT, sizeof(ChunkConstants), 0);
+	pipelineLayoutCreateInfo.pushConstantRangeCount = 1;
+	pipelineLayoutCreateInfo.pPushConstantRanges = &pushConstantRange;
+
 	vkTools::checkResult(vkCreatePipelineLayout(device, &pipelineLayoutCreateInfo, nullptr, &computePipelineLayout));
 }
 
@@ -257,14 +792,9 @@ void VulkanTerrain::setupDescriptorSet() {
 	std::vector<VkWriteDescriptorSet> writeDescriptorSets = {
 		vkTools::initializers::writeDescriptorSet(
 			computeDescriptorSet,
-			VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER,
-			0,
-			&uniformData.compute.descriptor),
-		vkTools::initializers::writeDescriptorSet(
-			computeDescriptorSet,
-			VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER,
+			VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
 			1,
-			&uniformData.lookup.descriptor),
+			&triTableBuffer.descriptor),
 		vkTools::initializers::writeDescriptorSet(
 			computeDescriptorSet,
 			VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
@@ -274,87 +804,150 @@ void VulkanTerrain::setupDescriptorSet() {
 			computeDescriptorSet,
 			VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
 			3,
-			&storageBuffers.index_buffer.descriptor)
+			&storageBuffers.index_buffer.descriptor),
+		vkTools::initializers::writeDescriptorSet(
+			computeDescriptorSet,
+			VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+			4,
+			&storageBuffers.draw_buffer.descriptor),
+		vkTools::initializers::writeDescriptorSet(
+			computeDescriptorSet,
+			VK_DESCRIPTOR_TYPE_STORAGE_IMAGE,
+			5,
+			&densityAtlas.descriptor),
+		vkTools::initializers::writeDescriptorSet(
+			computeDescriptorSet,
+			VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+			6,
+			&storageBuffers.edge_buffer.descriptor)
 	};
 
 	vkUpdateDescriptorSets(device, writeDescriptorSets.size(), writeDescriptorSets.data(), 0, NULL);
 }
 
 void VulkanTerrain::createComputeCommandBuffer() {
+	// Command buffers can only be submitted to queues of the family their pool was created for
+	VkCommandPoolCreateInfo cmdPoolInfo = {};
+	cmdPoolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+	cmdPoolInfo.queueFamilyIndex = queueFamilyIndices.compute;
+	cmdPoolInfo.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
+	vkTools::checkResult(vkCreateCommandPool(device, &cmdPoolInfo, nullptr, &computeCmdPool));
+
 	VkCommandBufferAllocateInfo cmdBufAllocateInfo =
 		vkTools::initializers::commandBufferAllocateInfo(
-			cmdPool,
+			computeCmdPool,
 			VK_COMMAND_BUFFER_LEVEL_PRIMARY,
 			1);
 
 	vkTools::checkResult(vkAllocateCommandBuffers(device, &cmdBufAllocateInfo, &computeCmdBuffer));
+
+	VkFenceCreateInfo fenceCreateInfo = vkTools::initializers::fenceCreateInfo(VK_FLAGS_NONE);
+	vkTools::checkResult(vkCreateFence(device, &fenceCreateInfo, nullptr, &computeFence));
+
+	// A single batch is in flight at a time, so one set of queries is enough
+	if (profile)
+		profiler = new GpuProfiler(physicalDevice, device, queueFamilyIndices.compute, 1, { "mesh", "readback" });
 }
 
 void VulkanTerrain::preparePipeline() {
+	// A workgroup keeps the densities of its cells and their margin in shared memory
+	const VkPhysicalDeviceLimits &limits = deviceProperties.limits;
+	auto supported = [&limits](glm::uvec3 size) {
+		return size.x * size.y * size.z <= limits.maxComputeWorkGroupInvocations &&
+			size.x <= limits.maxComputeWorkGroupSize[0] &&
+			size.y <= limits.maxComputeWorkGroupSize[1] &&
+			size.z <= limits.maxComputeWorkGroupSize[2] &&
+			(size.x + 3) * (size.y + 3) * (size.z + 3) * sizeof(float) <= limits.maxComputeSharedMemorySize;
+	};
+	if (meshWorkgroupSize != glm::uvec3(0) && (glm::any(glm::equal(meshWorkgroupSize, glm::uvec3(0))) || !supported(meshWorkgroupSize))) {
+		std::cout << "Workgroup size " << meshWorkgroupSize.x << "x" << meshWorkgroupSize.y << "x" << meshWorkgroupSize.z << " is not supported by the device\n";
+		meshWorkgroupSize = glm::uvec3(0);
+	}
+	if (meshWorkgroupSize == glm::uvec3(0))
+		meshWorkgroupSize = supported(glm::uvec3(8)) ? glm::uvec3(8) : glm::uvec3(4);
+
+	// Specialization constants of BuildMesh.comp in the order of their constant IDs,
+	// the pipeline is compiled for this chunk size and workgroup shape
+	uint32_t specializationData[7] = {
+		Chunk::CHUNK_SIZE,
+		meshWorkgroupSize.x, meshWorkgroupSize.y, meshWorkgroupSize.z,
+		ARENA_SLOT_VERTICES, ARENA_SLOT_INDICES,
+		VK_FALSE
+	};
+	std::array<VkSpecializationMapEntry, 7> specializationEntries;
+	for (uint32_t i = 0; i < specializationEntries.size(); ++i)
+		specializationEntries[i] = { i, i * (uint32_t)sizeof(uint32_t), sizeof(uint32_t) };
+	VkSpecializationInfo specializationInfo = {};
+	specializationInfo.mapEntryCount = (uint32_t)specializationEntries.size();
+	specializationInfo.pMapEntries = specializationEntries.data();
+	specializationInfo.dataSize = sizeof(specializationData);
+	specializationInfo.pData = specializationData;
+
 	VkComputePipelineCreateInfo computePipelineCreateInfo =
 		vkTools::initializers::computePipelineCreateInfo(
 			computePipelineLayout,
 			0);
 	computePipelineCreateInfo.stage = loadShader("./../data/shaders/BuildMesh.comp.spv", VK_SHADER_STAGE_COMPUTE_BIT);
+	computePipelineCreateInfo.stage.pSpecializationInfo = &specializationInfo;
 	vkTools::checkResult(vkCreateComputePipelines(device, pipelineCache, 1, &computePipelineCreateInfo, nullptr, &pipelines.compute));
-}
 
-void VulkanTerrain::prepareUniformBuffers() {
-	createBuffer(
-		VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
-		sizeof(uboCompute),
-		&uboCompute,
-		&uniformData.compute.buffer,
-		&uniformData.compute.memory,
-		&uniformData.compute.descriptor);
-
-	uboLookup.triTable = &triTable;
-
-#define LOOKUP_SIZE 256*16*sizeof(int32_t)
-
-	createBuffer(
-		VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
-		LOOKUP_SIZE,
-		&uboLookup,
-		&uniformData.lookup.buffer,
-		&uniformData.lookup.memory,
-		&uniformData.lookup.descriptor);
-
-	uint8_t *pData;
-	vkTools::checkResult(vkMapMemory(device, uniformData.lookup.memory, 0, LOOKUP_SIZE, 0, (void**)&pData));
-	memcpy(pData, &uboLookup, LOOKUP_SIZE);
-	vkUnmapMemory(device, uniformData.lookup.memory);
-
-#undef LOOKUP_SIZE
+	// The vertex pass is the same shader with VERTEX_PASS set
+	specializationData[6] = VK_TRUE;
+	vkTools::checkResult(vkCreateComputePipelines(device, pipelineCache, 1, &computePipelineCreateInfo, nullptr, &pipelines.vertices));
+	specializationData[6] = VK_FALSE;
+
+	computePipelineCreateInfo.stage = loadShader("./../data/shaders/Density.comp.spv", VK_SHADER_STAGE_COMPUTE_BIT);
+	computePipelineCreateInfo.stage.pSpecializationInfo = &specializationInfo;
+	vkTools::checkResult(vkCreateComputePipelines(device, pipelineCache, 1, &computePipelineCreateInfo, nullptr, &pipelines.density));
 }
 
-void VulkanTerrain::updateUniformBuffers(Chunk currentChunk) {
-	uboCompute.worldPos = currentChunk.worldPosition;
-	uint8_t *pData;
-	vkTools::checkResult(vkMapMemory(device, uniformData.compute.memory, 0, sizeof(uboCompute), 0, (void**)&pData));
-	memcpy(pData, &uboCompute, sizeof(uboCompute));
-	vkUnmapMemory(device, uniformData.compute.memory);
+void VulkanTerrain::prepareTriTable() {
+	// Each case holds at most 5 triangles: edges 0-7 go into the nibbles of x, edges 8-14 into
+	// the lower nibbles of y and the triangle count into the top nibble of y. Matches BuildMesh.comp
+	glm::uvec2 packed[256];
+	for (uint32_t caseID = 0; caseID < 256; ++caseID) {
+		packed[caseID] = glm::uvec2(0);
+		uint32_t v = 0;
+		for (; triTable[caseID][v] != -1; ++v)
+			packed[caseID][v / 8] |= (uint32_t)triTable[caseID][v] << (4 * (v % 8));
+		assert(v <= 15 && v % 3 == 0);
+		packed[caseID].y |= (v / 3) << 28;
+	}
+
+	VkBufferCreateInfo bufferInfo =
+		vkTools::initializers::bufferCreateInfo(
+			VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+			sizeof(packed));
+	// Written by the setup command buffer on the graphics queue
+	uint32_t sharedQueueFamilies[2] = { queueFamilyIndices.graphics, queueFamilyIndices.compute };
+	if (queueFamilyIndices.graphics != queueFamilyIndices.compute) {
+		bufferInfo.sharingMode = VK_SHARING_MODE_CONCURRENT;
+		bufferInfo.queueFamilyIndexCount = 2;
+		bufferInfo.pQueueFamilyIndices = sharedQueueFamilies;
+	}
+	vkTools::checkResult(vkCreateBuffer(device, &bufferInfo, nullptr, &triTableBuffer.buffer));
+	triTableBuffer.memory = allocator->allocateBuffer(triTableBuffer.buffer, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+	triTableBuffer.descriptor = { triTableBuffer.buffer, 0, sizeof(packed) };
+	vkCmdUpdateBuffer(setupCmdBuffer, triTableBuffer.buffer, 0, sizeof(packed), (const uint32_t*)packed);
 }
 
-void VulkanTerrain::getComputeQueue() {
-	uint32_t queueIndex = 0;
-	uint32_t queueCount;
-	vkGetPhysicalDeviceQueueFamilyProperties(physicalDevice, &queueCount, NULL);
-	assert(queueCount > 0);
-
-	std::vector<VkQueueFamilyProperties> queueProperties;
-	queueProperties.resize(queueCount);
-	vkGetPhysicalDeviceQueueFamilyProperties(physicalDevice, &queueCount, queueProperties.data());
-
-	for (queueIndex = 0; queueIndex < queueCount; ++queueIndex)
-		if (queueProperties[queueIndex].queueFlags & VK_QUEUE_COMPUTE_BIT)
-			break;
-	assert(queueIndex < queueCount);
-
-	VkDeviceQueueCreateInfo queueCreateInfo = {};
-	queueCreateInfo.queueFamilyIndex = queueIndex;
-	queueCreateInfo.queueCount = 1;
-	vkGetDeviceQueue(device, queueIndex, 0, &queue);
+// Constants are pushed when the compute command buffer is recorded, nothing has to be written to the device
+void VulkanTerrain::updateChunkConstants(const std::vector<Chunk> &batch, const std::vector<uint32_t> &slots) {
+	for (size_t c = 0; c < batch.size(); ++c) {
+		chunkConstants[c].position = glm::ivec4(batch[c].worldPosition, slots[c]);
+		chunkConstants[c].lod = glm::uvec4(batch[c].lod, batch[c].seamFaces, c, batch[c].skirtFaces);
+
+		// Host meshes evaluate their own densities, the atlas only holds what Density.comp wrote
+		chunkConstants[c].brick = glm::ivec4(0);
+		if (cpuMesher != nullptr)
+			continue;
+		uint32_t brick = densityCache.find(batch[c].worldPosition, batch[c].lod);
+		bool evaluate = brick == DensityCache::NO_BRICK;
+		if (evaluate)
+			brick = densityCache.insert(batch[c].worldPosition, batch[c].lod);
+		glm::uvec3 brickPosition(brick % densityAtlas.bricks.x, (brick / densityAtlas.bricks.x) % densityAtlas.bricks.y, brick / (densityAtlas.bricks.x * densityAtlas.bricks.y));
+		chunkConstants[c].brick = glm::ivec4(brickPosition * DENSITY_BRICK_SIZE, evaluate ? 1 : 0);
+	}
 }
 
 void VulkanTerrain::prepare() {
@@ -362,35 +955,63 @@ void VulkanTerrain::prepare() {
 		vkDebug::setupDebugging(instance, VK_DEBUG_REPORT_ERROR_BIT_EXT | VK_DEBUG_REPORT_WARNING_BIT_EXT, NULL);
 	createCommandPool();
 	createSetupCommandBuffer();
-	setupSwapChain();
-	createCommandBuffers();
-	setupRenderPass();
+	// The window, swapchain and render pass belong to meshRenderer
 	createPipelineCache();
 
-	getComputeQueue();
 	createComputeCommandBuffer();
 	prepareStorageBuffers();
-	prepareUniformBuffers();
+	prepareDensityAtlas();
+	prepareTriTable();
 	setupDescriptorSetLayout();
 	preparePipeline();
 	setupDescriptorPool();
 	setupDescriptorSet();
-	buildComputeCommandBuffer();
+	flushSetupCommandBuffer();
+	// The arena never moves, so the renderer records its command buffers once on top of it
+	if (meshRenderer != nullptr)
+		meshRenderer->prepare();
 	prepared = true;
-	loadMesh();
+	if (!benchmark)
+		loadMesh();
 }
 
 void VulkanTerrain::render() {
-	while (TRUE) {
-		meshRenderer->renderLoop();
+	if (benchmark) {
+		runBenchmark();
+		return;
+	}
+	if (headless) {
+		// Without a window the chunks around viewerPosition are generated once, then the application exits
+		auto tStart = std::chrono::high_resolution_clock::now();
+		do {
+			loadMesh();
+			std::this_thread::yield();
+		} while (generating());
+		auto tEnd = std::chrono::high_resolution_clock::now();
+		std::cout << "Generated " << meshedChunks << " chunks in "
+			<< std::chrono::duration<double, std::milli>(tEnd - tStart).count() << " ms\n";
+		if (!pendingChunks.empty())
+			std::cout << pendingChunks.size() << " chunks did not fit into the mesh arena\n";
+		if (profiler != nullptr)
+			profiler->report(std::cout);
+		allocator->report(std::cout);
+		return;
+	}
+	// Chunk generation is advanced once per frame
+	auto tReport = std::chrono::high_resolution_clock::now();
+	while (meshRenderer->renderFrame()) {
 		loadMesh();
+		auto tNow = std::chrono::high_resolution_clock::now();
+		if (profiler != nullptr && tNow - tReport > std::chrono::seconds(1)) {
+			profiler->report(std::cout);
+			tReport = tNow;
+		}
 	}
 }
 
-void VulkanTerrain::compute() {
+void VulkanTerrain::compute(const std::vector<uint32_t> &slots) {
 	if (!prepared)
 		return;
-	vkDeviceWaitIdle(device);
+	buildComputeCommandBuffer(slots);
 	draw();
-	vkDeviceWaitIdle(device);
-}
\ No newline at end of file
+}
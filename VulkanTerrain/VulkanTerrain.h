@@ -1,7 +1,15 @@
 #pragma once
 
+#include <algorithm>
+
 #include "VulkanBase.h"
+#include "Benchmark.hpp"
 #include "Chunk.hpp"
+#include "ChunkCache.hpp"
+#include "Density.hpp"
+#include "ChunkManager.hpp"
+#include "DensityCache.hpp"
+#include "CpuMesher.h"
 #include "Mesh.h"
 #include "MarchingCubesLookup.h"
 
@@ -10,56 +18,158 @@ public:
 	const uint32_t VISIBILITY_DISTANCE = 8;
 	//                            chunks in x axis              chunks in y axis              chunks in z axis
 	const uint32_t CHUNK_COUNT = (2 * VISIBILITY_DISTANCE + 1) * (2 * VISIBILITY_DISTANCE + 1) * (VISIBILITY_DISTANCE + 1);
+	// Number of chunks generated by a single compute submission, each has its own edge grid in the edge buffer
+	static const uint32_t COMPUTE_BATCH_SIZE = 16;
+	// Resident chunk meshes live in fixed size slots of the mesh arena, passed to BuildMesh.comp as specialization constants
+	const uint32_t ARENA_SLOT_COUNT = 1024;
+	const uint32_t ARENA_SLOT_VERTICES = 8192;
+	const uint32_t ARENA_SLOT_INDICES = 32768;
 	
-	struct {
-		glm::ivec3 worldPos;
-	} uboCompute;
+	// Chunks up to LOD_RING_WIDTH chunks away from the camera are meshed at full resolution,
+	// every further ring of that width halves the resolution up to Chunk::MAX_LOD, see ChunkManager
+	const uint32_t LOD_RING_WIDTH = 2;
+	// Empty and solid chunks are forgotten once they are this many chunks outside of the window
+	const int UNIFORM_CACHE_MARGIN = 4;
 
-	typedef int table[256][16];
-	struct {
-		table * triTable;
-	} uboLookup;
+	// Density fields are kept in bricks of a 3D atlas so that chunks can be meshed again without evaluating
+	// the noise, see DensityCache. A brick holds the samples of a chunk with a margin of one sample on each side
+	const uint32_t DENSITY_BRICK_COUNT = 256;
+	static const uint32_t DENSITY_BRICK_SIZE = Chunk::CHUNK_SIZE + 3;
 
-	struct {
-		vkTools::UniformData compute;
-		vkTools::UniformData lookup;
-	} uniformData;
+	// Pushed before the dispatches of each chunk of the batch. Matches ChunkConstants in BuildMesh.comp
+	struct ChunkConstants {
+		// xyz holds the chunk origin, w its arena slot
+		glm::ivec4 position;
+		// x holds the level of detail, y the seam faces, z the chunk's index in the batch and w the skirt faces
+		glm::uvec4 lod;
+		// xyz holds the origin of the chunk's density brick, w is set when its densities have to be evaluated
+		glm::ivec4 brick;
+	};
+	ChunkConstants chunkConstants[COMPUTE_BATCH_SIZE];
+
+	// triTable packed into 8 bytes per case, see prepareTriTable
+	vkTools::UniformData triTableBuffer;
+
+	// Indirect draw of one arena slot, filled in by the mesher. Matches ChunkDraw in BuildMesh.comp
+	struct ChunkDrawCommand {
+		VkDrawIndexedIndirectCommand draw;
+		// Output allocation of the mesher
+		uint32_t vertexCount;
+		uint32_t indexReserved;
+		// ChunkContents of the chunk's samples
+		uint32_t contents;
+		// Origin of the chunk in the slot in xyz and in w how far its skirts reach past it, used for culling
+		glm::ivec4 chunkPosition;
+	};
 
 	struct {
 		vkTools::UniformData vertex_buffer;
 		vkTools::UniformData index_buffer;
+		vkTools::UniformData draw_buffer;
+		// Vertex of each edge of the batch's chunks, passed from the vertex to the index pass of BuildMesh.comp
+		vkTools::UniformData edge_buffer;
 	} storageBuffers;
 
+	vkTools::UniformData drawReadBuffer;
+
 	struct {
+		VkImage image;
+		vkTools::Allocation mem;
+		VkImageView view;
+		VkDescriptorImageInfo descriptor;
+		// Number of bricks along each axis
+		glm::uvec3 bricks;
+	} densityAtlas;
+	DensityCache densityCache;
+
+	struct {
+		VkPipeline density;
+		// Vertex and index pass of BuildMesh.comp
+		VkPipeline vertices;
 		VkPipeline compute;
 	} pipelines;
 
-	VkQueue computeQueue;
+	// Cells meshed by one workgroup of BuildMesh.comp, set with -workgroup XxYxZ or chosen from the device limits
+	glm::uvec3 meshWorkgroupSize = glm::uvec3(0);
+
+	// Regions of the compute command buffer measured by the profiler
+	enum ProfilerRegion {
+		PROFILE_MESH,
+		PROFILE_READBACK
+	};
+
+	VkCommandPool computeCmdPool;
 	VkCommandBuffer computeCmdBuffer;
+	VkFence computeFence;
+	// A single batch is generated at a time, it is read back once computeFence is signalled
+	bool computeInFlight = false;
+	std::vector<Chunk> computeBatch;
+	std::vector<uint32_t> computeSlots;
 	VkPipelineLayout computePipelineLayout;
 	VkDescriptorSet computeDescriptorSet;
 	VkDescriptorSetLayout computeDescriptorSetLayout;
 
-	Mesh *meshRenderer;
+	// Not created in headless mode
+	Mesh *meshRenderer = nullptr;
+	// Center of the generated chunk window when there is no camera
+	glm::vec3 viewerPosition = glm::vec3(0.0f);
+
+	ChunkCache chunkCache;
+	// Chunks read back from the mesher, reported by headless runs
+	size_t meshedChunks = 0;
+	std::vector<uint32_t> freeArenaSlots;
+	// Released slots with the renderer's frame that removes their draw. They are handed out
+	// again once that frame has finished, earlier frames may still draw from them
+	std::vector<std::pair<uint64_t, uint32_t>> retiringArenaSlots;
+	ChunkManager chunkManager;
+	ChunkUpdate chunkUpdate;
+	// Chunks waiting for a free arena slot, keyed by world position
+	std::unordered_map<glm::ivec3, Chunk, ChunkHash> pendingChunks;
+
+	// Generates the chunks on the host instead of BuildMesh.comp, enabled with -cpumesher
+	CpuMesher *cpuMesher = nullptr;
+	// Meshes of the batch being generated by cpuMesher
+	std::vector<std::future<ChunkMesh>> cpuMeshes;
+	// Host visible copy of a finished batch, copied into the arena slots of the batch
+	vkTools::UniformData cpuMeshStagingBuffer;
+	// Draws of the staged batch with their final counts
+	std::vector<ChunkDrawCommand> stagedDraws;
 
 	VulkanTerrain(bool enableValidation);
 	~VulkanTerrain();
 
 	void loadMesh();
-	void buildComputeCommandBuffer();
+	// True while chunks of the current window are still being generated
+	bool generating() const;
+	void releaseChunk(glm::ivec3 worldPosition);
+	// Empties the slot's draw and hands the slot out again once no frame in flight draws from it
+	void retireArenaSlot(uint32_t slot);
+	// True when the chunks are drawn by meshRenderer, the benchmark only generates them
+	bool drawsChunks() const;
+	bool isUniformChunk(const Chunk &chunk);
+	void readChunkDraws(const std::vector<Chunk> &batch, const std::vector<uint32_t> &slots);
+	void stageCpuMeshes();
+	void waitForCompute();
+	// Generates every scene with the GPU and the host mesher and writes the results to stdout, see -benchmark
+	void runBenchmark();
+	void benchmarkScene(const BenchmarkScene &scene, BenchmarkResult &result);
+	// Meshes the chunk in the middle of the scene with BuildMesh.comp and compares it with CpuMesher
+	void checkMeshers(const BenchmarkScene &scene, MesherCheck &check);
+	// Copies the mesh of an arena slot back to the host through cpuMeshStagingBuffer
+	void readArenaSlot(uint32_t slot, uint32_t vertexCount, uint32_t indexCount, ChunkMesh &mesh);
+	void buildComputeCommandBuffer(const std::vector<uint32_t> &slots);
 	void draw();
 	void prepareStorageBuffers();
-	void readStorageBuffers(std::vector<Vertex> &vertexBuffer_complete, std::vector<uint32_t> &indexBuffer_complete);
+	void prepareDensityAtlas();
 	void setupDescriptorPool();
 	void setupDescriptorSetLayout();
 	void setupDescriptorSet();
 	void preparePipeline();
 	void createComputeCommandBuffer();
-	void prepareUniformBuffers();
-	void updateUniformBuffers(Chunk currentChunk);
-	void getComputeQueue();
+	void prepareTriTable();
+	void updateChunkConstants(const std::vector<Chunk> &batch, const std::vector<uint32_t> &slots);
 	void prepare();
 	void render();
-	void compute();
+	void compute(const std::vector<uint32_t> &slots);
 };
 
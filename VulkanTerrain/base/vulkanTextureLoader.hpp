@@ -11,6 +11,8 @@
 #include <vulkan/vulkan.h>
 #include <gli/gli.hpp>
 
+#include "vulkanallocator.hpp"
+
 namespace vkTools 
 {
 
@@ -19,7 +21,7 @@ namespace vkTools
 		VkSampler sampler;
 		VkImage image;
 		VkImageLayout imageLayout;
-		VkDeviceMemory deviceMemory;
+		Allocation deviceMemory;
 		VkImageView view;
 		uint32_t width, height;
 		uint32_t mipLevels;
@@ -34,23 +36,7 @@ namespace vkTools
 		VkQueue queue;
 		VkCommandBuffer cmdBuffer;
 		VkCommandPool cmdPool;
-		VkPhysicalDeviceMemoryProperties deviceMemoryProperties;
-
-		// Try to find appropriate memory type for a memory allocation
-		VkBool32 getMemoryType(uint32_t typeBits, VkFlags properties, uint32_t *typeIndex)
-		{
-			for (int i = 0; i < 32; i++) {
-				if ((typeBits & 1) == 1) {
-					if ((deviceMemoryProperties.memoryTypes[i].propertyFlags & properties) == properties)
-					{
-						*typeIndex = i;
-						return true;
-					}
-				}
-				typeBits >>= 1;
-			}
-			return false;
-		}
+		VulkanAllocator *allocator;
 	public:
 		// Load a 2D texture
 		void loadTexture(const char* filename, VkFormat format, VulkanTexture *texture)
@@ -99,8 +85,6 @@ namespace vkTools
 			imageCreateInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
 			imageCreateInfo.initialLayout = VK_IMAGE_LAYOUT_PREINITIALIZED;
 
-			VkMemoryAllocateInfo memAllocInfo = vkTools::initializers::memoryAllocateInfo();
-			VkMemoryRequirements memReqs;
 
 			// Use a separate command buffer for texture loading
 			VkCommandBufferBeginInfo cmdBufInfo = vkTools::initializers::commandBufferBeginInfo();
@@ -112,7 +96,7 @@ namespace vkTools
 				// and copy to optimal tiling target
 				struct MipLevel {
 					VkImage image;
-					VkDeviceMemory memory;
+					Allocation memory;
 				};
 				std::vector<MipLevel> mipLevels;
 				mipLevels.resize(texture->mipLevels);
@@ -126,11 +110,7 @@ namespace vkTools
 
 					vkTools::checkResult(vkCreateImage(device, &imageCreateInfo, nullptr, &mipLevels[level].image));
 
-					vkGetImageMemoryRequirements(device, mipLevels[level].image, &memReqs);
-					memAllocInfo.allocationSize = memReqs.size;
-					getMemoryType(memReqs.memoryTypeBits, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT, &memAllocInfo.memoryTypeIndex);
-					vkTools::checkResult(vkAllocateMemory(device, &memAllocInfo, nullptr, &mipLevels[level].memory));
-					vkTools::checkResult(vkBindImageMemory(device, mipLevels[level].image, mipLevels[level].memory, 0));
+					mipLevels[level].memory = allocator->allocateImage(mipLevels[level].image, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, true);
 
 					VkImageSubresource subRes = {};
 					subRes.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
@@ -139,9 +119,8 @@ namespace vkTools
 					void *data;
 
 					vkGetImageSubresourceLayout(device, mipLevels[level].image, &subRes, &subResLayout);
-					vkTools::checkResult(vkMapMemory(device, mipLevels[level].memory, 0, memReqs.size, 0, &data));
+					data = mipLevels[level].memory.mapped;
 					memcpy(data, tex2D[level].data(), tex2D[level].size());
-					vkUnmapMemory(device, mipLevels[level].memory);
 
 					// Image barrier for linear image (base)
 					// Linear image will be used as a source for the copy
@@ -161,13 +140,7 @@ namespace vkTools
 
 				vkTools::checkResult(vkCreateImage(device, &imageCreateInfo, nullptr, &texture->image));
 
-				vkGetImageMemoryRequirements(device, texture->image, &memReqs);
-
-				memAllocInfo.allocationSize = memReqs.size;
-
-				getMemoryType(memReqs.memoryTypeBits, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &memAllocInfo.memoryTypeIndex);
-				vkTools::checkResult(vkAllocateMemory(device, &memAllocInfo, nullptr, &texture->deviceMemory));
-				vkTools::checkResult(vkBindImageMemory(device, texture->image, texture->deviceMemory, 0));
+				texture->deviceMemory = allocator->allocateImage(texture->image, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
 
 				VkImageSubresourceRange subresourceRange = {};
 				subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
@@ -252,7 +225,7 @@ namespace vkTools
 				for (uint32_t i = 0; i < mipLevels.size(); i++)
 				{
 					vkDestroyImage(device, mipLevels[i].image, nullptr);
-					vkFreeMemory(device, mipLevels[i].memory, nullptr);
+					allocator->free(mipLevels[i].memory);
 				}
 			}
 			else
@@ -265,25 +238,14 @@ namespace vkTools
 				assert(formatProperties.linearTilingFeatures & VK_FORMAT_FEATURE_SAMPLED_IMAGE_BIT);
 
 				VkImage mappableImage;
-				VkDeviceMemory mappableMemory;
+				Allocation mappableMemory;
 
 				// Load mip map level 0 to linear tiling image
 				vkTools::checkResult(vkCreateImage(device, &imageCreateInfo, nullptr, &mappableImage));
 
 				// Get memory requirements for this image 
 				// like size and alignment
-				vkGetImageMemoryRequirements(device, mappableImage, &memReqs);
-				// Set memory allocation size to required memory size
-				memAllocInfo.allocationSize = memReqs.size;
-
-				// Get memory type that can be mapped to host memory
-				getMemoryType(memReqs.memoryTypeBits, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT, &memAllocInfo.memoryTypeIndex);
-
-				// Allocate host memory
-				vkTools::checkResult(vkAllocateMemory(device, &memAllocInfo, nullptr, &mappableMemory));
-
-				// Bind allocated image for use
-				vkTools::checkResult(vkBindImageMemory(device, mappableImage, mappableMemory, 0));
+				mappableMemory = allocator->allocateImage(mappableImage, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, true);
 
 				// Get sub resource layout
 				// Mip map count, array layer, etc.
@@ -299,12 +261,11 @@ namespace vkTools
 				vkGetImageSubresourceLayout(device, mappableImage, &subRes, &subResLayout);
 
 				// Map image memory
-				vkTools::checkResult(vkMapMemory(device, mappableMemory, 0, memReqs.size, 0, &data));
+				data = mappableMemory.mapped;
 
 				// Copy image data into memory
 				memcpy(data, tex2D[subRes.mipLevel].data(), tex2D[subRes.mipLevel].size());
 
-				vkUnmapMemory(device, mappableMemory);
 
 				// Linear tiled images don't need to be staged
 				// and can be directly used as textures
@@ -379,16 +340,16 @@ namespace vkTools
 			vkDestroyImageView(device, texture.view, nullptr);
 			vkDestroyImage(device, texture.image, nullptr);
 			vkDestroySampler(device, texture.sampler, nullptr);
-			vkFreeMemory(device, texture.deviceMemory, nullptr);
+			allocator->free(texture.deviceMemory);
 		}
 
-		VulkanTextureLoader(VkPhysicalDevice physicalDevice, VkDevice device, VkQueue queue, VkCommandPool cmdPool)
+		VulkanTextureLoader(VkPhysicalDevice physicalDevice, VkDevice device, VkQueue queue, VkCommandPool cmdPool, VulkanAllocator *allocator)
 		{
 			this->physicalDevice = physicalDevice;
 			this->device = device;
 			this->queue = queue;
 			this->cmdPool = cmdPool;
-			vkGetPhysicalDeviceMemoryProperties(physicalDevice, &deviceMemoryProperties);
+			this->allocator = allocator;
 
 			// Create command buffer for submitting image barriers
 			// and converting tilings
@@ -432,12 +393,10 @@ namespace vkTools
 			imageCreateInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
 			imageCreateInfo.initialLayout = VK_IMAGE_LAYOUT_PREINITIALIZED;
 
-			VkMemoryAllocateInfo memAllocInfo = vkTools::initializers::memoryAllocateInfo();
-			VkMemoryRequirements memReqs;
 
 			struct {
 				VkImage image;
-				VkDeviceMemory memory;
+				Allocation memory;
 			} cubeFace[6];
 
 			VkCommandBufferBeginInfo cmdBufInfo = vkTools::initializers::commandBufferBeginInfo();
@@ -449,11 +408,7 @@ namespace vkTools
 			{
 				vkTools::checkResult(vkCreateImage(device, &imageCreateInfo, nullptr, &cubeFace[face].image));
 
-				vkGetImageMemoryRequirements(device, cubeFace[face].image, &memReqs);
-				memAllocInfo.allocationSize = memReqs.size;
-				getMemoryType(memReqs.memoryTypeBits, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT, &memAllocInfo.memoryTypeIndex);
-				vkTools::checkResult(vkAllocateMemory(device, &memAllocInfo, nullptr, &cubeFace[face].memory));
-				vkTools::checkResult(vkBindImageMemory(device, cubeFace[face].image, cubeFace[face].memory, 0));
+				cubeFace[face].memory = allocator->allocateImage(cubeFace[face].image, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, true);
 
 				VkImageSubresource subRes = {};
 				subRes.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
@@ -462,9 +417,8 @@ namespace vkTools
 				void *data;
 
 				vkGetImageSubresourceLayout(device, cubeFace[face].image, &subRes, &subResLayout);
-				vkTools::checkResult(vkMapMemory(device, cubeFace[face].memory, 0, memReqs.size, 0, &data));
+				data = cubeFace[face].memory.mapped;
 				memcpy(data, texCube[face][subRes.mipLevel].data(), texCube[face][subRes.mipLevel].size());
-				vkUnmapMemory(device, cubeFace[face].memory);
 
 				// Image barrier for linear image (base)
 				// Linear image will be used as a source for the copy
@@ -486,13 +440,7 @@ namespace vkTools
 
 			vkTools::checkResult(vkCreateImage(device, &imageCreateInfo, nullptr, &texture->image));
 
-			vkGetImageMemoryRequirements(device, texture->image, &memReqs);
-
-			memAllocInfo.allocationSize = memReqs.size;
-
-			getMemoryType(memReqs.memoryTypeBits, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &memAllocInfo.memoryTypeIndex);
-			vkTools::checkResult(vkAllocateMemory(device, &memAllocInfo, nullptr, &texture->deviceMemory));
-			vkTools::checkResult(vkBindImageMemory(device, texture->image, texture->deviceMemory, 0));
+			texture->deviceMemory = allocator->allocateImage(texture->image, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
 
 			// Image barrier for optimal image (target)
 			// Optimal image will be used as destination for the copy
@@ -601,7 +549,7 @@ namespace vkTools
 			for (auto& face : cubeFace)
 			{
 				vkDestroyImage(device, face.image, nullptr);
-				vkFreeMemory(device, face.memory, nullptr);
+				allocator->free(face.memory);
 			}
 		}
 
@@ -632,12 +580,10 @@ namespace vkTools
 			imageCreateInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
 			imageCreateInfo.initialLayout = VK_IMAGE_LAYOUT_PREINITIALIZED;
 
-			VkMemoryAllocateInfo memAllocInfo = vkTools::initializers::memoryAllocateInfo();
-			VkMemoryRequirements memReqs;
 
 			struct Layer {
 				VkImage image;
-				VkDeviceMemory memory;
+				Allocation memory;
 			};
 			std::vector<Layer> arrayLayer;
 			arrayLayer.resize(texture->layerCount);
@@ -661,11 +607,7 @@ namespace vkTools
 			{
 				vkTools::checkResult(vkCreateImage(device, &imageCreateInfo, nullptr, &arrayLayer[i].image));
 
-				vkGetImageMemoryRequirements(device, arrayLayer[i].image, &memReqs);
-				memAllocInfo.allocationSize = memReqs.size;
-				getMemoryType(memReqs.memoryTypeBits, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT, &memAllocInfo.memoryTypeIndex);
-				vkTools::checkResult(vkAllocateMemory(device, &memAllocInfo, nullptr, &arrayLayer[i].memory));
-				vkTools::checkResult(vkBindImageMemory(device, arrayLayer[i].image, arrayLayer[i].memory, 0));
+				arrayLayer[i].memory = allocator->allocateImage(arrayLayer[i].image, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, true);
 
 				VkImageSubresource subRes = {};
 				subRes.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
@@ -674,9 +616,8 @@ namespace vkTools
 				void *data;
 
 				vkGetImageSubresourceLayout(device, arrayLayer[i].image, &subRes, &subResLayout);
-				vkTools::checkResult(vkMapMemory(device, arrayLayer[i].memory, 0, memReqs.size, 0, &data));
+				data = arrayLayer[i].memory.mapped;
 				memcpy(data, tex2DArray[i].data(), tex2DArray[i].size());
-				vkUnmapMemory(device, arrayLayer[i].memory);
 
 				// Image barrier for linear image (base)
 				// Linear image will be used as a source for the copy
@@ -697,13 +638,7 @@ namespace vkTools
 
 			vkTools::checkResult(vkCreateImage(device, &imageCreateInfo, nullptr, &texture->image));
 
-			vkGetImageMemoryRequirements(device, texture->image, &memReqs);
-
-			memAllocInfo.allocationSize = memReqs.size;
-
-			getMemoryType(memReqs.memoryTypeBits, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &memAllocInfo.memoryTypeIndex);
-			vkTools::checkResult(vkAllocateMemory(device, &memAllocInfo, nullptr, &texture->deviceMemory));
-			vkTools::checkResult(vkBindImageMemory(device, texture->image, texture->deviceMemory, 0));
+			texture->deviceMemory = allocator->allocateImage(texture->image, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
 
 			// Image barrier for optimal image (target)
 			// Optimal image will be used as destination for the copy
@@ -811,7 +746,7 @@ namespace vkTools
 			for (auto& layer : arrayLayer)
 			{
 				vkDestroyImage(device, layer.image, nullptr);
-				vkFreeMemory(device, layer.memory, nullptr);
+				allocator->free(layer.memory);
 			}
 		}
 
@@ -0,0 +1,256 @@
+/*
+* Pooled device memory allocator for Vulkan
+*
+* This code is licensed under the MIT license (MIT) (http://opensource.org/licenses/MIT)
+*/
+
+#pragma once
+
+#include <algorithm>
+#include <iterator>
+#include <map>
+#include <ostream>
+#include <vector>
+
+#include "vulkan/vulkan.h"
+#include "vulkantools.h"
+
+namespace vkTools
+{
+	// Places resources in a few large blocks of device memory instead of allocating memory for each of them,
+	// which is slow and limited to maxMemoryAllocationCount allocations. Every memory type has a pool of
+	// blocks, resources too large to share a block get a dedicated one. Host visible blocks are mapped once
+	// when they are created, so allocations can be written through Allocation::mapped at any time
+	class VulkanAllocator
+	{
+	public:
+		// Size of the shared blocks, capped to a fraction of small heaps
+		static const VkDeviceSize DEFAULT_BLOCK_SIZE = 64 * 1024 * 1024;
+
+		VulkanAllocator(VkPhysicalDevice physicalDevice, VkDevice device, VkDeviceSize blockSize = DEFAULT_BLOCK_SIZE)
+			: device(device), blockSize(blockSize)
+		{
+			vkGetPhysicalDeviceMemoryProperties(physicalDevice, &memoryProperties);
+			VkPhysicalDeviceProperties properties;
+			vkGetPhysicalDeviceProperties(physicalDevice, &properties);
+			maxAllocationCount = properties.limits.maxMemoryAllocationCount;
+			// Linear and optimal resources use separate pools, so bufferImageGranularity never has to be respected
+			pools.resize(2 * memoryProperties.memoryTypeCount);
+		}
+
+		~VulkanAllocator()
+		{
+			for (auto &pool : pools)
+				for (auto &block : pool.blocks)
+					vkFreeMemory(device, block.memory, nullptr);
+		}
+
+		VulkanAllocator(const VulkanAllocator &) = delete;
+		VulkanAllocator &operator=(const VulkanAllocator &) = delete;
+
+		// Linear resources are buffers and images with linear tiling
+		Allocation allocate(const VkMemoryRequirements &memReqs, VkMemoryPropertyFlags properties, bool linear)
+		{
+			uint32_t memoryType = getMemoryType(memReqs.memoryTypeBits, properties);
+			uint32_t poolIndex = 2 * memoryType + (linear ? 0 : 1);
+			Pool &pool = pools[poolIndex];
+			VkDeviceSize sharedSize = getBlockSize(memoryType);
+			bool dedicated = memReqs.size > sharedSize / 2;
+
+			Block *block = nullptr;
+			VkDeviceSize offset = 0;
+			if (!dedicated)
+				for (auto &candidate : pool.blocks)
+					if (!candidate.dedicated && candidate.take(memReqs.size, memReqs.alignment, &offset)) {
+						block = &candidate;
+						break;
+					}
+			if (block == nullptr) {
+				pool.blocks.push_back(createBlock(memoryType, dedicated ? memReqs.size : sharedSize, dedicated));
+				block = &pool.blocks.back();
+				bool taken = block->take(memReqs.size, memReqs.alignment, &offset);
+				assert(taken);
+			}
+
+			Allocation allocation;
+			allocation.memory = block->memory;
+			allocation.offset = offset;
+			allocation.size = memReqs.size;
+			allocation.mapped = (block->mapped != nullptr) ? (uint8_t*)block->mapped + offset : nullptr;
+			allocation.pool = poolIndex;
+			pool.allocationCount++;
+			pool.usedSize += memReqs.size;
+			return allocation;
+		}
+
+		// Allocates memory for the buffer and binds it
+		Allocation allocateBuffer(VkBuffer buffer, VkMemoryPropertyFlags properties)
+		{
+			VkMemoryRequirements memReqs;
+			vkGetBufferMemoryRequirements(device, buffer, &memReqs);
+			Allocation allocation = allocate(memReqs, properties, true);
+			vkTools::checkResult(vkBindBufferMemory(device, buffer, allocation.memory, allocation.offset));
+			return allocation;
+		}
+
+		// Allocates memory for the image and binds it
+		Allocation allocateImage(VkImage image, VkMemoryPropertyFlags properties, bool linear = false)
+		{
+			VkMemoryRequirements memReqs;
+			vkGetImageMemoryRequirements(device, image, &memReqs);
+			Allocation allocation = allocate(memReqs, properties, linear);
+			vkTools::checkResult(vkBindImageMemory(device, image, allocation.memory, allocation.offset));
+			return allocation;
+		}
+
+		// Returns the range to its block, dedicated blocks are freed right away. A pool keeps at most one
+		// empty shared block around for the next allocations. Resets the allocation
+		void free(Allocation &allocation)
+		{
+			if (allocation.memory == VK_NULL_HANDLE)
+				return;
+			Pool &pool = pools[allocation.pool];
+			auto block = std::find_if(pool.blocks.begin(), pool.blocks.end(),
+				[&](const Block &b) { return b.memory == allocation.memory; });
+			assert(block != pool.blocks.end());
+			pool.allocationCount--;
+			pool.usedSize -= allocation.size;
+			if (block->dedicated) {
+				vkFreeMemory(device, block->memory, nullptr);
+				pool.blocks.erase(block);
+			}
+			else {
+				block->release(allocation.offset, allocation.size);
+				bool spareExists = std::any_of(pool.blocks.begin(), pool.blocks.end(),
+					[&](const Block &b) { return &b != &*block && !b.dedicated && b.isEmpty(); });
+				if (block->isEmpty() && spareExists) {
+					vkFreeMemory(device, block->memory, nullptr);
+					pool.blocks.erase(block);
+				}
+			}
+			allocation = Allocation();
+		}
+
+		// Writes the usage of every pool and the number of device memory allocations
+		void report(std::ostream &out) const
+		{
+			const double MB = 1024.0 * 1024.0;
+			uint32_t blockCount = 0;
+			for (size_t p = 0; p < pools.size(); ++p) {
+				const Pool &pool = pools[p];
+				if (pool.blocks.empty())
+					continue;
+				VkDeviceSize reserved = 0;
+				VkDeviceSize largestFree = 0;
+				for (auto &block : pool.blocks) {
+					reserved += block.size;
+					for (auto &range : block.freeRanges)
+						largestFree = std::max(largestFree, range.second);
+				}
+				blockCount += (uint32_t)pool.blocks.size();
+				out << "memory type " << p / 2 << ((p % 2 == 0) ? " linear" : " optimal") << ": "
+					<< pool.allocationCount << " allocations using " << pool.usedSize / MB << " of " << reserved / MB
+					<< " MB in " << pool.blocks.size() << " blocks, largest free range " << largestFree / MB << " MB\n";
+			}
+			out << "device memory allocations: " << blockCount << " of " << maxAllocationCount << "\n";
+		}
+
+	private:
+		struct Block
+		{
+			VkDeviceMemory memory = VK_NULL_HANDLE;
+			VkDeviceSize size = 0;
+			void *mapped = nullptr;
+			bool dedicated = false;
+			// Size of every free range by offset, adjacent ranges are always merged
+			std::map<VkDeviceSize, VkDeviceSize> freeRanges;
+
+			bool isEmpty() const
+			{
+				return freeRanges.size() == 1 && freeRanges.begin()->second == size;
+			}
+
+			// Places the range at the first free range it fits in
+			bool take(VkDeviceSize size, VkDeviceSize alignment, VkDeviceSize *offset)
+			{
+				for (auto range = freeRanges.begin(); range != freeRanges.end(); ++range) {
+					VkDeviceSize rangeStart = range->first;
+					VkDeviceSize rangeEnd = range->first + range->second;
+					VkDeviceSize start = (rangeStart + alignment - 1) / alignment * alignment;
+					if (start + size > rangeEnd)
+						continue;
+					freeRanges.erase(range);
+					if (start > rangeStart)
+						freeRanges[rangeStart] = start - rangeStart;
+					if (start + size < rangeEnd)
+						freeRanges[start + size] = rangeEnd - start - size;
+					*offset = start;
+					return true;
+				}
+				return false;
+			}
+
+			void release(VkDeviceSize offset, VkDeviceSize size)
+			{
+				auto next = freeRanges.lower_bound(offset);
+				if (next != freeRanges.end() && offset + size == next->first) {
+					size += next->second;
+					next = freeRanges.erase(next);
+				}
+				if (next != freeRanges.begin()) {
+					auto previous = std::prev(next);
+					if (previous->first + previous->second == offset) {
+						previous->second += size;
+						return;
+					}
+				}
+				freeRanges[offset] = size;
+			}
+		};
+
+		struct Pool
+		{
+			std::vector<Block> blocks;
+			uint32_t allocationCount = 0;
+			VkDeviceSize usedSize = 0;
+		};
+
+		VkDevice device;
+		VkDeviceSize blockSize;
+		VkPhysicalDeviceMemoryProperties memoryProperties;
+		uint32_t maxAllocationCount;
+		// Two pools per memory type, see allocate
+		std::vector<Pool> pools;
+
+		uint32_t getMemoryType(uint32_t typeBits, VkMemoryPropertyFlags properties) const
+		{
+			for (uint32_t i = 0; i < memoryProperties.memoryTypeCount; i++)
+				if ((typeBits & (1u << i)) != 0 && (memoryProperties.memoryTypes[i].propertyFlags & properties) == properties)
+					return i;
+			vkTools::exitFatal("No memory type with the requested properties", "Fatal error");
+			return 0;
+		}
+
+		VkDeviceSize getBlockSize(uint32_t memoryType) const
+		{
+			VkDeviceSize heapSize = memoryProperties.memoryHeaps[memoryProperties.memoryTypes[memoryType].heapIndex].size;
+			return std::min(blockSize, heapSize / 8);
+		}
+
+		Block createBlock(uint32_t memoryType, VkDeviceSize size, bool dedicated)
+		{
+			VkMemoryAllocateInfo memAlloc = vkTools::initializers::memoryAllocateInfo();
+			memAlloc.allocationSize = size;
+			memAlloc.memoryTypeIndex = memoryType;
+
+			Block block;
+			block.size = size;
+			block.dedicated = dedicated;
+			block.freeRanges[0] = size;
+			vkTools::checkResult(vkAllocateMemory(device, &memAlloc, nullptr, &block.memory));
+			if ((memoryProperties.memoryTypes[memoryType].propertyFlags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) != 0)
+				vkTools::checkResult(vkMapMemory(device, block.memory, 0, VK_WHOLE_SIZE, 0, &block.mapped));
+			return block;
+		}
+	};
+}
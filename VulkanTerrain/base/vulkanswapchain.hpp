@@ -79,7 +79,7 @@ public:
 
 	VkSwapchainKHR swapChain = VK_NULL_HANDLE;
 
-	uint32_t imageCount;
+	uint32_t imageCount = 0;
 	std::vector<VkImage> images;
 	std::vector<SwapChainBuffer> buffers;
 
@@ -7,6 +7,7 @@
 */
 
 #include "vulkantools.h"
+#include "vulkanallocator.hpp"
 
 namespace vkTools
 {
@@ -409,10 +410,10 @@ namespace vkTools
 		return imageMemoryBarrier;
 	}
 
-	void destroyUniformData(VkDevice device, vkTools::UniformData *uniformData)
+	void destroyUniformData(VkDevice device, VulkanAllocator *allocator, vkTools::UniformData *uniformData)
 	{
 		vkDestroyBuffer(device, uniformData->buffer, nullptr);
-		vkFreeMemory(device, uniformData->memory, nullptr);
+		allocator->free(uniformData->memory);
 	}
 }
 
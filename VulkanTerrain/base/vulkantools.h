@@ -92,18 +92,32 @@ namespace vkTools
 	// Transforms the image's layout back from present khr to color attachment
 	VkImageMemoryBarrier postPresentBarrier(VkImage presentImage);
 
+	class VulkanAllocator;
+
+	// Range of a memory block handed out by VulkanAllocator
+	struct Allocation
+	{
+		VkDeviceMemory memory = VK_NULL_HANDLE;
+		VkDeviceSize offset = 0;
+		VkDeviceSize size = 0;
+		// Host address of offset for host visible memory, blocks stay mapped as long as they exist
+		void *mapped = nullptr;
+		// Pool of the allocator the block belongs to
+		uint32_t pool = 0;
+	};
+
 	// Contains all vulkan objects
 	// required for a uniform data object
 	struct UniformData 
 	{
 		VkBuffer buffer;
-		VkDeviceMemory memory;
+		Allocation memory;
 		VkDescriptorBufferInfo descriptor;
 		uint32_t allocSize;
 	};
 
 	// Destroy (and free) Vulkan resources used by a uniform data structure
-	void destroyUniformData(VkDevice device, vkTools::UniformData *uniformData);
+	void destroyUniformData(VkDevice device, VulkanAllocator *allocator, vkTools::UniformData *uniformData);
 
 	// Contains often used vulkan object initializers
 	// Save lot of VK_STRUCTURE_TYPE assignments
@@ -1,5 +1,8 @@
 glslangvalidator -V render.vert -o render.vert.spv
 glslangvalidator -V render.frag -o render.frag.spv
+glslangvalidator -V Density.comp -o Density.comp.spv
 glslangvalidator -V BuildMesh.comp -o BuildMesh.comp.spv
+glslangvalidator -V Cull.comp -o Cull.comp.spv
+glslangvalidator -V DepthPyramid.comp -o DepthPyramid.comp.spv
 
 pause
\ No newline at end of file